@@ -937,15 +937,16 @@ void String::Swap(String& refer)
 String& jsonhead::String::operator=(String && refer)
 {
   this->Swap(refer);
-  refer.tm = this->tm;
-  this->tm = false;
+  std::swap(tm, refer.tm);
   return *this;
 }
 
 String& String::operator=(const String& refer)
 {
-  if (first != nullptr)
+  if (first != nullptr && !tm)
     delete[] first;
+  first = last = nullptr;
+  tm = false;
   if (length = refer.length)
   {
     first = new char[length + 1];
@@ -957,7 +958,7 @@ String& String::operator=(const String& refer)
 
 void String::CloneSet(const String& refer)
 {
-  if (first != nullptr)
+  if (first != nullptr && !tm)
     delete[] first;
   first = nullptr;
   tm = true;
@@ -1820,4 +1821,14 @@ void String::InitString(const char *str)
   first = new char[length + 1];
   last = first + length - 1;
   memcpy(first, str, (length + 1) * sizeof(char));
+}
+
+void String::InitString(const char *str, size_t len)
+{
+  length = len;
+  first = new char[length + 1];
+  last = first + length - 1;
+  if (length > 0)
+    memcpy(first, str, length * sizeof(char));
+  first[length] = 0;
 }
\ No newline at end of file
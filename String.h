@@ -220,7 +220,7 @@ public:
 
   String() : length(0), first(nullptr), last(first) { }
   String(const char *str) { InitString(str); }
-  String(const char *str, size_t len) { InitString(str); }
+  String(const char *str, size_t len) { InitString(str, len); }
   explicit String(char *str, size_t len, bool built_in = true);
   String(char ch, size_t count);
   String(char ch);
@@ -232,8 +232,8 @@ public:
   String(unsigned long long int);
   String(float);
   String(double);
-  String(String&& ws) : first(ws.first), last(ws.last), 
-    length(ws.length) { ws.tm = true; }
+  String(String&& ws) noexcept : first(ws.first), last(ws.last), 
+    length(ws.length), tm(ws.tm) { ws.tm = true; }
   String(const String& cnt) : String((const char *)cnt.first, cnt.length) {}
   String(std::string& str) : String(&str[0], str.length()) { }
   String(const std::string& str) : String(str.c_str(), str.length()) { }
@@ -258,6 +258,9 @@ public:
   {
     if (refer.length != this->length)
       return false;
+    // Interned strings share their text.
+    if (first == refer.first)
+      return true;
     return !memcmp(first, refer.first, length * sizeof(char));
   }
 
@@ -345,7 +348,7 @@ public:
   inline bool operator>(const String& compare) const
   { return ::strcmp(first, compare.first) > 0; }
   inline bool operator<(const String& compare) const
-  { return ::strcmp(first, compare.first) < 0; }
+  { return first != compare.first && ::strcmp(first, compare.first) < 0; }
   inline bool operator>=(const String& compare) const
   { return !this->operator<(compare); }
   inline bool operator<=(const String& compare) const
@@ -561,6 +564,7 @@ private:
 
   /// Copy to String pointer.
   void InitString(const char *str);
+  void InitString(const char *str, size_t len);
 };
 
 inline String operator"" _s(const char* str, size_t length)
@@ -9,658 +9,4119 @@
 //===----------------------------------------------------------------------===//
 
 #include "jsonhead.h"
+#include <cmath>
 #include <sstream>
 #include <set>
 
+#ifdef _OS_WINDOWS
+#define NOMINMAX
+#include <Windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define _read ::read
+#define _write ::write
+#define _close ::close
+#endif
+#include <errno.h>
+
+#ifdef CONFIG_GZIP
+#include <zlib.h>
+#endif
+
+#if defined(__AVX2__)
+#define JSONHEAD_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define JSONHEAD_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef __PCLMUL__
+#include <wmmintrin.h>
+#endif
+#ifdef _COMPILER_MS
+#include <intrin.h>
+#endif
+
+#ifdef CONFIG_ALLOCATOR
 ///===-----------------------------------------------------------------------===
 ///
-///               Json Lexer
+///               Json Allocator
 ///
 ///===-----------------------------------------------------------------------===
 
-jsonhead::json_lexer::json_lexer(std::string file_path, long long buffer_size) 
-  : ifs(file_path), curtok(json_token::none), buffer_size(buffer_size) {
-  ifs.seekg(0, std::ios::end);
-  file_size = ifs.tellg();
-  ifs.seekg(0, std::ios::beg);
+void *jsonhead::json_arena::allocate_block(size_t size, size_t align) {
+  size_t need = size + align;
+  size_t capacity = std::max(block_size, need);
 
-  buffer = new char[buffer_size];
-  memset(buffer, 0, buffer_size);
+  if (!blocks.empty() && block + 1 < blocks.size()) {
+    // Reuse the block kept by rewind().
+    block++;
+    if (blocks[block].second < need)
+      blocks[block] = { std::unique_ptr<char[]>(new char[capacity]), capacity };
+  }
+  else {
+    blocks.emplace_back(std::unique_ptr<char[]>(new char[capacity]), capacity);
+    block = blocks.size() - 1;
+  }
 
-  if (!ifs)
-    throw std::runtime_error("file not found!");
+  offset = 0;
+  return allocate(size, align);
 }
 
-jsonhead::json_lexer::~json_lexer() {
-  delete[] buffer;
-  ifs.close();
+char *jsonhead::json_arena::allocate_string(const char *str, size_t len) {
+  char *ptr = (char *)allocate(len + 1, 1);
+  if (len > 0)
+    memcpy(ptr, str, len);
+  ptr[len] = 0;
+  return ptr;
 }
 
-bool jsonhead::json_lexer::next() {
-  this->curstr = String();
-  while (true) {
-    auto cur = next_ch();
-    if (cur == 0) {
-      curtok = json_token::eof;
-      return true;
-    }
+size_t jsonhead::json_arena::reserved() const {
+  size_t size = 0;
+  for (auto& b : blocks)
+    size += b.second;
+  return size;
+}
 
-    switch (cur)
-    {
-    case ' ':
-    case '\r':
-    case '\n':
-    case '\t':
-      continue;
+uint64_t jsonhead::json_symbol_table::hash(const char *ptr, size_t len) {
+  // FNV-1a, keys are short.
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)ptr[i]) * 0x100000001b3ULL;
+  return h;
+}
 
-    case ',':
-      this->curtok = json_token::v_comma;
-      this->curstr = String(cur, 1);
-      break;
+const jsonhead::json_shape *jsonhead::json_shape::empty() {
+  static const json_shape shape;
+  return &shape;
+}
 
-    case ':':
-      this->curtok = json_token::v_pair;
-      this->curstr = String(cur, 1);
-      break;
+jsonhead::json_shape *jsonhead::json_shape::create(json_arena& arena, const String *keys, size_t size) {
+  json_shape *shape = new (arena.allocate(sizeof(json_shape), alignof(json_shape))) json_shape();
+  String *copy = (String *)arena.allocate(size * sizeof(String), alignof(String));
+  for (size_t i = 0; i < size; i++)
+    new (&copy[i]) String((char *)keys[i].Reference(), keys[i].Length());
 
-    case '{':
-      this->curtok = json_token::object_starts;
-      this->curstr = String(cur, 1);
-      break;
+  // Half full at most.
+  size_t slots = 4;
+  while (slots < size * 2)
+    slots *= 2;
+  uint32_t *index = (uint32_t *)arena.allocate(slots * sizeof(uint32_t), alignof(uint32_t));
+  memset(index, 0, slots * sizeof(uint32_t));
+  for (size_t i = 0; i < size; i++) {
+    size_t j = (size_t)json_symbol_table::hash(keys[i].Reference(), keys[i].Length()) & (slots - 1);
+    while (index[j] != 0)
+      j = (j + 1) & (slots - 1);
+    index[j] = (uint32_t)i + 1;
+  }
 
-    case '}':
-      this->curtok = json_token::object_ends;
-      this->curstr = String(cur, 1);
-      break;
+  shape->size = size;
+  shape->keys = copy;
+  shape->index = index;
+  shape->mask = slots - 1;
+  return shape;
+}
 
-    case '[':
-      this->curtok = json_token::array_starts;
-      this->curstr = String(cur, 1);
-      break;
+size_t jsonhead::json_shape::find(const char *key, size_t len) const {
+  if (size == 0)
+    return npos;
+  size_t found = npos;
+  size_t i = (size_t)json_symbol_table::hash(key, len) & mask;
+  for (; index[i] != 0; i = (i + 1) & mask) {
+    size_t position = index[i] - 1;
+    if (keys[position].Length() == len && !memcmp(keys[position].Reference(), key, len))
+      found = std::min(found, position);
+  }
+  return found;
+}
 
-    case ']':
-      this->curtok = json_token::array_ends;
-      this->curstr = String(cur, 1);
-      break;
+const jsonhead::json_shape *jsonhead::json_symbol_table::shape(const uint32_t *ids, size_t count) {
+  if (shape_list.size() * 2 >= shape_slots.size())
+    grow_shapes();
 
-    case 't':
-    case 'f':
-    case 'n':
-      {
-        StringBuilder ss(10);
-        while (cur && isalpha(cur))
-        {
-          ss.Append(cur);
-          cur = next_ch();
-        }
-        prev();
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < count; i++)
+    h = (h ^ ids[i]) * 0x100000001b3ULL;
 
-        auto s = ss.ToString();
-        if (s == "true")
-          this->curtok = json_token::v_true;
-        else if (s == "false")
-          this->curtok = json_token::v_false;
-        else if (s == "null")
-          this->curtok = json_token::v_null;
-        else
-          return false;
+  size_t mask = shape_slots.size() - 1;
+  size_t i = (size_t)h & mask;
+  for (; shape_slots[i] != 0; i = (i + 1) & mask) {
+    auto candidate = shape_list[shape_slots[i] - 1];
+    if (shape_hashes[shape_slots[i] - 1] != h || candidate->size != count)
+      continue;
+    // Interned keys are equal when they are the same text.
+    size_t k = 0;
+    while (k < count && candidate->keys[k].Reference() == names[ids[k]].Reference())
+      k++;
+    if (k == count)
+      return candidate;
+  }
 
-        this->curstr = s;
-      }
-      break;
+  if (shape_list.size() >= limit)
+    return nullptr;
+  std::vector<String> keys;
+  keys.reserve(count);
+  for (size_t k = 0; k < count; k++)
+    keys.emplace_back((char *)names[ids[k]].Reference(), names[ids[k]].Length());
+  auto shape = json_shape::create(arena, keys.data(), count);
+  shape_slots[i] = (uint32_t)shape_list.size() + 1;
+  shape_list.push_back(shape);
+  shape_hashes.push_back(h);
+  return shape;
+}
 
-    case '"':
-      {
-        StringBuilder ss;
+void jsonhead::json_symbol_table::grow_shapes() {
+  std::vector<uint32_t> grown(std::max<size_t>(shape_slots.size() * 2, 64));
+  size_t mask = grown.size() - 1;
+  for (uint32_t id = 0; id < shape_list.size(); id++) {
+    size_t i = (size_t)shape_hashes[id] & mask;
+    while (grown[i] != 0)
+      i = (i + 1) & mask;
+    grown[i] = id + 1;
+  }
+  shape_slots.swap(grown);
+}
 
-        // donot parse \uXXXX unicode style character
-        while (cur = next_ch())
-        {
-          if (cur == '"') break;
-#if REAL_JSON
-          // escapes
-          if (1 <= cur && cur <= 19) return false;
-#endif
-#if !CONFIG_DISABLE_UTF8
-          // We will be support wide characters.
-          if (cur < 0) {
-            unsigned char cc = cur;
-            int len = 0;
-            if ((cc & 0xfc) == 0xfc) {
-              len = 6;
-            }
-            else if ((cc & 0xf8) == 0xf8) {
-              len = 5;
-            }
-            else if ((cc & 0xf0) == 0xf0) {
-              len = 4;
-            }
-            else if ((cc & 0xe0) == 0xe0) {
-              len = 3;
-            }
-            else if ((cc & 0xc0) == 0xc0) {
-              len = 2;
-            }
-            for (; --len; cur = next_ch())
-              ss.Append(cur);
-            ss.Append(cur);
-            continue;
-          }
-#endif
-          ss.Append(cur);
-          if (cur == '\\') {
-            if (!(cur = next_ch()))
-              return false;
-            ss.Append(cur);
-          }
-        }
+uint32_t jsonhead::json_symbol_table::find(const char *ptr, size_t len) const {
+  if (slots.empty())
+    return npos;
+  uint64_t h = hash(ptr, len);
+  size_t mask = slots.size() - 1;
+  for (size_t i = (size_t)h & mask; slots[i] != 0; i = (i + 1) & mask) {
+    uint32_t id = slots[i] - 1;
+    if (hashes[id] == h && names[id].Length() == len && !memcmp(names[id].Reference(), ptr, len))
+      return id;
+  }
+  return npos;
+}
 
-        curtok = json_token::v_string;
-        curstr = ss.ToString();
-      }
+uint32_t jsonhead::json_symbol_table::intern(const char *ptr, size_t len) {
+  // Half full at most.
+  if (names.size() * 2 >= slots.size())
+    grow();
 
-      break;
+  uint64_t h = hash(ptr, len);
+  size_t mask = slots.size() - 1;
+  size_t i = (size_t)h & mask;
+  for (; slots[i] != 0; i = (i + 1) & mask) {
+    uint32_t id = slots[i] - 1;
+    if (hashes[id] == h && names[id].Length() == len && !memcmp(names[id].Reference(), ptr, len))
+      return id;
+  }
 
-    default:
-      {
-        StringBuilder ss;
+  if (names.size() >= limit)
+    return npos;
+  uint32_t id = (uint32_t)names.size();
+  names.emplace_back(arena.allocate_string(ptr, len), len);
+  hashes.push_back(h);
+  slots[i] = id + 1;
+  return id;
+}
 
-        if (cur == '-') {
-          ss.Append(cur);
-          cur = next_ch();
-        }
+void jsonhead::json_symbol_table::grow() {
+  std::vector<uint32_t> grown(std::max<size_t>(slots.size() * 2, 64));
+  size_t mask = grown.size() - 1;
+  for (uint32_t id = 0; id < names.size(); id++) {
+    size_t i = (size_t)hashes[id] & mask;
+    while (grown[i] != 0)
+      i = (i + 1) & mask;
+    grown[i] = id + 1;
+  }
+  slots.swap(grown);
+}
 
-        // [0-9]+
-        while (cur && isdigit(cur)) {
-          ss.Append(cur);
-          cur = next_ch();
-        }
-        
-        // [0-9]+.[0-9]+
-        if (cur && cur == '.') {
-          cur = next_ch();
-          if (!cur || !isdigit(cur))
-            return false;
-          
-          while (cur && isdigit(cur)) {
-            ss.Append(cur);
-            cur = next_ch();
-          }
-        }
-        
-        // [0-9]+[Ee][+-]?[0-9]+
-        // [0-9]+.[0-9]+[Ee][+-]?[0-9]+
-        if (cur && (cur == 'E' || cur == 'e')) {
-          cur = next_ch();
-          
-          if (!cur || !(cur == '+' || cur == '-' || isdigit(cur)))
-            return false;
-          
-          if (cur == '+' || cur == '-') {
-            ss.Append(cur);
-            cur = next_ch();
-          }
-          
-          if (!cur || !isdigit(cur))
-            return false;
-          
-          while (cur && isdigit(cur)) {
-            ss.Append(cur);
-            cur = next_ch();
-          }
-        }
-        prev();
+size_t jsonhead::json_symbol_table::memory_usage() const {
+  return arena.reserved() + names.capacity() * sizeof(String) + 
+         hashes.capacity() * sizeof(uint64_t) + slots.capacity() * sizeof(uint32_t) +
+         shape_list.capacity() * sizeof(json_shape *) + 
+         shape_hashes.capacity() * sizeof(uint64_t) + shape_slots.capacity() * sizeof(uint32_t);
+}
+#endif
 
-        curtok = json_token::v_number;
-        curstr = ss.ToString();
-      }
-    }
+///===-----------------------------------------------------------------------===
+///
+///               Json Structural Index
+///
+///===-----------------------------------------------------------------------===
 
-    return true;
-  }
+static inline int trailing_zeros(uint64_t bits) {
+#ifdef _COMPILER_MS
+  unsigned long index;
+  _BitScanForward64(&index, bits);
+  return (int)index;
+#else
+  return __builtin_ctzll(bits);
+#endif
 }
 
-jsonhead::json_token jsonhead::json_lexer::type() const {
-  return this->curtok;
+// Every bit is replaced by the xor of itself and all lower bits, which
+// turns a quote mask into an in-string mask.
+static inline uint64_t prefix_xor(uint64_t bits) {
+#ifdef __PCLMUL__
+  __m128i all_ones = _mm_set1_epi8('\xFF');
+  __m128i result = _mm_clmulepi64_si128(_mm_set_epi64x(0ULL, bits), all_ones, 0);
+  return (uint64_t)_mm_cvtsi128_si64(result);
+#else
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+#endif
 }
 
-jsonhead::String jsonhead::json_lexer::str() {
-  return std::move(this->curstr);
+namespace {
+
+struct json_block_masks {
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t op;
+  uint64_t whitespace;
+};
+
+#if defined(JSONHEAD_AVX2)
+inline uint64_t mask32(__m256i v, char ch) {
+  return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(ch)));
 }
 
-const char *jsonhead::json_lexer::gbuffer() const {
-  return pointer;
+inline void classify(const char *ptr, json_block_masks& m) {
+  m = json_block_masks{0, 0, 0, 0};
+  for (int i = 0; i < 2; i++) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(ptr + i * 32));
+    int shift = i * 32;
+    m.quote |= mask32(v, '"') << shift;
+    m.backslash |= mask32(v, '\\') << shift;
+    m.op |= (mask32(v, '{') | mask32(v, '}') | mask32(v, '[') | mask32(v, ']') |
+             mask32(v, ':') | mask32(v, ',')) << shift;
+    m.whitespace |= (mask32(v, ' ') | mask32(v, '\t') | mask32(v, '\n') |
+                     mask32(v, '\r')) << shift;
+  }
+}
+#elif defined(JSONHEAD_SSE2)
+inline uint64_t mask16(__m128i v, char ch) {
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(ch)));
 }
 
-inline void jsonhead::json_lexer::buffer_refresh() {
-  current_block_size = ifs.read(buffer, buffer_size).gcount();
-  read_size += current_block_size;
-  pointer = buffer;
+inline void classify(const char *ptr, json_block_masks& m) {
+  m = json_block_masks{0, 0, 0, 0};
+  for (int i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(ptr + i * 16));
+    int shift = i * 16;
+    m.quote |= mask16(v, '"') << shift;
+    m.backslash |= mask16(v, '\\') << shift;
+    m.op |= (mask16(v, '{') | mask16(v, '}') | mask16(v, '[') | mask16(v, ']') |
+             mask16(v, ':') | mask16(v, ',')) << shift;
+    m.whitespace |= (mask16(v, ' ') | mask16(v, '\t') | mask16(v, '\n') |
+                     mask16(v, '\r')) << shift;
+  }
+}
+#else
+inline void classify(const char *ptr, json_block_masks& m) {
+  m = json_block_masks{0, 0, 0, 0};
+  for (int i = 0; i < 64; i++) {
+    uint64_t bit = 1ULL << i;
+    switch (ptr[i])
+    {
+    case '"': m.quote |= bit; break;
+    case '\\': m.backslash |= bit; break;
+    case '{': case '}': case '[': case ']': case ':': case ',': m.op |= bit; break;
+    case ' ': case '\t': case '\n': case '\r': m.whitespace |= bit; break;
+    }
+  }
 }
+#endif
 
-inline bool jsonhead::json_lexer::require_refresh() {
-  return pointer == nullptr || buffer + current_block_size == pointer;
 }
 
-char jsonhead::json_lexer::next_ch() {
-  if (require_refresh()) {
-    if (ifs.eof())
-      return (char)0;
-    buffer_refresh();
-  }
-  return *pointer++;
+void jsonhead::json_structural_index::reset() {
+  prev_in_string = prev_escaped = prev_scalar = 0;
+  positions.clear();
 }
 
-void jsonhead::json_lexer::prev() {
-  pointer--;
+void jsonhead::json_structural_index::index(const char *ptr, size_t size) {
+  positions.clear();
+  positions.reserve(size / 8);
+
+  size_t offset = 0;
+  for (; offset + 64 <= size; offset += 64)
+    index_block(ptr + offset, 64, (uint32_t)offset);
+
+  if (offset < size) {
+    char tail[64];
+    memset(tail, ' ', 64);
+    memcpy(tail, ptr + offset, size - offset);
+    index_block(tail, size - offset, (uint32_t)offset);
+  }
 }
 
-///===-----------------------------------------------------------------------===
-///
-///               Json Model
-///
-///===-----------------------------------------------------------------------===
+void jsonhead::json_structural_index::resume(const char *begin, const char *ptr, bool in_string) {
+  positions.clear();
+  prev_in_string = in_string ? ~0ULL : 0ULL;
 
-std::ostream& jsonhead::json_object::print(std::ostream& os, bool format, std::string indent) const {
-  if (!format)
-    os << '{';
-  else
-    os << "{\n";
-  for (auto it = keyvalue.rbegin(); it != keyvalue.rend(); ++it) {
-    if (!format) {
-      os << '\"' << it->first << "\":";
-      it->second->print(os);
-    }
-    else {
-      os << indent << "  \"" << it->first << "\": ";
-      it->second->print(os, true, indent + "  ");
-    }
-    if (std::next(it) != keyvalue.rend()) {
-      if (!format)
-        os << ',';
-      else
-        os << ",\n";
+  // Odd backslash runs escape the next character.
+  size_t run = 0;
+  for (const char *p = ptr; p > begin && p[-1] == '\\'; p--)
+    run++;
+  prev_escaped = run & 1;
+
+  prev_scalar = 0;
+  if (ptr > begin) {
+    switch (ptr[-1])
+    {
+    case '{': case '}': case '[': case ']': case ':': case ',':
+    case ' ': case '\t': case '\n': case '\r': case '"':
+      break;
+    default:
+      prev_scalar = 1;
+      break;
     }
   }
-  if (!format)
-    os << '}';
-  else
-    os << '\n' << indent << "}";
-  return os;
 }
 
-std::ostream& jsonhead::json_array::print(std::ostream& os, bool format, std::string indent) const {
-  if (array.size() > 0) {
-    if (!format)
-      os << '[';
-    else
-      os << "[\n";
-    for (auto it = array.rbegin(); it != array.rend(); ++it) {
-      if (!format)
-        (*it)->print(os);
-      else {
-        os << indent << "  ";
-        (*it)->print(os, true, indent + "  ");
-      }
-      if (std::next(it) != array.rend()) {
-        if (!format)
-          os << ',';
+void jsonhead::json_structural_index::swap(json_structural_index& other) {
+  std::swap(prev_in_string, other.prev_in_string);
+  std::swap(prev_escaped, other.prev_escaped);
+  std::swap(prev_scalar, other.prev_scalar);
+  positions.swap(other.positions);
+}
+
+void jsonhead::json_structural_index::index_parallel(const char *begin, const char *ptr, size_t size,
+                                                      size_t window, std::vector<json_structural_index>& windows) {
+  size_t count = (size + window - 1) / window;
+  // Outside and inside a string for every window.
+  std::vector<json_structural_index> speculative(count * 2);
+  std::vector<std::thread> workers;
+
+  for (size_t i = 0; i < count; i++) {
+    const char *start = ptr + i * window;
+    size_t length = std::min(window, size - i * window);
+    workers.emplace_back([&, i, start, length]() {
+      for (int state = 0; state < 2; state++) {
+        auto& idx = speculative[i * 2 + state];
+        if (i == 0) {
+          // The first window continues from this index.
+          idx.prev_escaped = prev_escaped;
+          idx.prev_scalar = prev_scalar;
+          idx.prev_in_string = state ? ~0ULL : 0ULL;
+        }
         else
-          os << ",\n";
+          idx.resume(begin, start, state != 0);
+        idx.index(start, length);
       }
-    }
-    if (!format)
-      os << ']';
-    else
-      os << '\n' << indent << "]";
+    });
   }
-  else {
-    os << "[]";
+  for (auto& worker : workers)
+    worker.join();
+
+  // The quote state at the end of a window is the state of the next one.
+  windows.resize(count);
+  bool in_string = this->in_string();
+  for (size_t i = 0; i < count; i++) {
+    windows[i].swap(speculative[i * 2 + in_string]);
+    in_string = windows[i].in_string();
   }
-  return os;
 }
 
-std::ostream& jsonhead::json_numeric::print(std::ostream& os, bool format, std::string indent) const {
-  os << numstr;
-  return os;
-}
+void jsonhead::json_structural_index::index_block(const char *ptr, size_t len, uint32_t offset) {
+  const uint64_t even_bits = 0x5555555555555555ULL;
+  json_block_masks m;
+  classify(ptr, m);
 
-std::ostream& jsonhead::json_string::print(std::ostream& os, bool format, std::string indent) const {
-  os << '"' << str << '"';
-  return os;
-}
+  // Backslash runs of odd length escape the following character.
+  uint64_t backslash = m.backslash & ~prev_escaped;
+  uint64_t follows_escape = backslash << 1 | prev_escaped;
+  uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+  uint64_t sequences = odd_starts + backslash;
+  uint64_t overflow = sequences < odd_starts;
+  uint64_t escaped = (even_bits ^ (sequences << 1)) & follows_escape;
 
-std::ostream& jsonhead::json_state::print(std::ostream& os, bool format, std::string indent) const {
-  switch (type) 
-  {
-  case json_token::v_false:
-    os << "false";
-    break;
+  uint64_t quote = m.quote & ~escaped;
+  uint64_t in_string = prefix_xor(quote) ^ prev_in_string;
 
-  case json_token::v_true:
-    os << "true";
-    break;
+  uint64_t scalar = ~(m.op | m.whitespace);
+  uint64_t nonquote_scalar = scalar & ~quote;
+  uint64_t follows_scalar = nonquote_scalar << 1 | prev_scalar;
 
-  case json_token::v_null:
-    os << "null";
-    break;
+  // Keep the opening quote, drop everything inside the string and its
+  // closing quote.
+  uint64_t starts = (m.op | (scalar & ~follows_scalar)) & ~(in_string ^ quote);
+
+  if (len < 64) {
+    uint64_t valid = (1ULL << len) - 1;
+    starts &= valid;
+    prev_in_string = (in_string >> (len - 1) & 1) ? ~0ULL : 0ULL;
+    prev_scalar = nonquote_scalar >> (len - 1) & 1;
+    prev_escaped = escaped >> len & 1;
+  }
+  else {
+    prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+    prev_scalar = nonquote_scalar >> 63;
+    prev_escaped = overflow;
+  }
+
+  while (starts) {
+    positions.push_back(offset + trailing_zeros(starts));
+    starts &= starts - 1;
   }
-  return os;
 }
 
 ///===-----------------------------------------------------------------------===
 ///
-///               Json Parser
+///               Json Lexer
 ///
 ///===-----------------------------------------------------------------------===
 
-static int goto_table[][20] = 
-{
-  {   0,   1,   3,   2,   0,   0,   0,   0,   4,   0,   0,   0,   5,   0,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  28 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  -1 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  -2 },
-  {   0,   0,   0,   0,   7,   8,   0,   0,   0,   6,   0,   0,   0,   0,   0,   0,   0,   9,   0,   0 },
-  {   0,   0,  16,  15,   0,   0,  11,  12,   4,   0,   0,   0,   5,  10,  17,  18,  19,  13,  14,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -5,  -5,   0,   0,  -5,   0,   0,   0,   0,   0,  -5 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  20,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -7,  21,   0,   0,   0,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  22,   0,   0,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -3,  -3,   0,   0,  -3,   0,   0,   0,   0,   0,  -3 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  23,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  24,   0,   0, -10,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -12, -12,   0,   0, -12,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -13, -13,   0,   0, -13,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -14, -14,   0,   0, -14,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -15, -15,   0,   0, -15,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -16, -16,   0,   0, -16,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -17, -17,   0,   0, -17,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -18, -18,   0,   0, -18,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -6,  -6,   0,   0,  -6,   0,   0,   0,   0,   0,  -6 },
-  {   0,   0,   0,   0,  25,   8,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   9,   0,   0 },
-  {   0,   0,  16,  15,   0,   0,   0,  26,   4,   0,   0,   0,   5,   0,  17,  18,  19,  13,  14,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -4,  -4,   0,   0,  -4,   0,   0,   0,   0,   0,  -4 },
-  {   0,   0,  16,  15,   0,   0,  27,  12,   4,   0,   0,   0,   5,   0,  17,  18,  19,  13,  14,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -8,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -9,  -9,   0,   0,   0,   0,   0,   0,   0,   0,   0 },
-  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, -11,   0,   0,   0,   0,   0,   0 },
-};
+const char *jsonhead::json_scan_string(const char *ptr, const char *end) {
+#if defined(JSONHEAD_AVX2)
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  for (; ptr + 32 <= end; ptr += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)ptr);
+    __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                      _mm256_cmpeq_epi8(v, backslash));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(special);
+    if (mask != 0)
+      return ptr + trailing_zeros(mask);
+  }
+#endif
+#if defined(JSONHEAD_AVX2) || defined(JSONHEAD_SSE2)
+  const __m128i quote16 = _mm_set1_epi8('"');
+  const __m128i backslash16 = _mm_set1_epi8('\\');
+  for (; ptr + 16 <= end; ptr += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)ptr);
+    __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, quote16),
+                                   _mm_cmpeq_epi8(v, backslash16));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(special);
+    if (mask != 0)
+      return ptr + trailing_zeros(mask);
+  }
+#endif
+  for (; ptr < end; ptr++)
+    if (*ptr == '"' || *ptr == '\\')
+      return ptr;
+  return end;
+}
 
-static int production[] = {
-   1,   1,   1,   2,   3,   2,   3,   1,   3,   3,   1,   3,   1,   1,   1,   1,   1,   1,   1
-};
+// First byte of the text of a string token which strict json does not
+// allow, nullptr if there is none. Malformed UTF-8 is reported at the
+// start of the sequence, invalid escapes after the backslash.
+static const char *json_check_string(const char *ptr, const char *end) {
+#if defined(JSONHEAD_AVX2) || defined(JSONHEAD_SSE2)
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i backslash = _mm_set1_epi8('\\');
+#endif
+  while (ptr < end) {
+#if defined(JSONHEAD_AVX2) || defined(JSONHEAD_SSE2)
+    // Printable ascii is skipped at once, bytes from 0x80 are below the
+    // space as signed bytes.
+    if (end - ptr >= 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)ptr);
+      __m128i special = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                     _mm_cmpeq_epi8(v, backslash));
+      uint32_t mask = (uint32_t)_mm_movemask_epi8(special);
+      if (mask == 0) {
+        ptr += 16;
+        continue;
+      }
+      ptr += trailing_zeros(mask);
+    }
+#endif
+    unsigned char ch = (unsigned char)*ptr;
+    if (ch < 0x20)
+      return ptr;
 
-static int group_table[] ={
-   0,   1,   1,   2,   2,   3,   3,   4,   4,   5,   6,   6,   7,   7,   7,   7,   7,   7,   7
-};
+    if (ch == '\\') {
+      ptr++;
+      switch (ptr < end ? *ptr : 0)
+      {
+      case '"': case '\\': case '/': 
+      case 'b': case 'f': case 'n': case 'r': case 't':
+        ptr++;
+        break;
 
-#define ACCEPT_INDEX 28
+      case 'u':
+        for (int i = 1; i <= 4; i++)
+          if (ptr + i == end || !isxdigit((unsigned char)ptr[i]))
+            return ptr + i;
+        ptr += 5;
+        break;
 
-jsonhead::json_parser::json_parser(std::string file_path, size_t pool_capacity)
-  : lex(file_path)
-#ifdef CONFIG_ALLOCATOR
-  , jarray_pool(pool_capacity), jobject_pool(pool_capacity), jstring_pool(pool_capacity),
-    jnumeric_pool(pool_capacity), jstate_pool(pool_capacity)
+      default:
+        return ptr;
+      }
+      continue;
+    }
+
+    if (ch < 0x80) {
+      ptr++;
+      continue;
+    }
+
+    // Well-formed sequences of Unicode table 3-7, which leaves out overlong
+    // forms, surrogates and code points above U+10FFFF.
+    int follow;
+    unsigned char low = 0x80, high = 0xbf;
+    if (ch >= 0xc2 && ch <= 0xdf)
+      follow = 1;
+    else if (ch >= 0xe0 && ch <= 0xef) {
+      follow = 2;
+      if (ch == 0xe0) low = 0xa0;
+      if (ch == 0xed) high = 0x9f;
+    }
+    else if (ch >= 0xf0 && ch <= 0xf4) {
+      follow = 3;
+      if (ch == 0xf0) low = 0x90;
+      if (ch == 0xf4) high = 0x8f;
+    }
+    else
+      return ptr;
+    if (end - ptr <= follow)
+      return ptr;
+    for (int i = 1; i <= follow; i++, low = 0x80, high = 0xbf)
+      if ((unsigned char)ptr[i] < low || (unsigned char)ptr[i] > high)
+        return ptr;
+    ptr += follow + 1;
+  }
+  return nullptr;
+}
+
+const char *jsonhead::json_skip_whitespace(const char *ptr, const char *end) {
+#if defined(JSONHEAD_AVX2)
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i carriage = _mm256_set1_epi8('\r');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  for (; ptr + 32 <= end; ptr += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)ptr);
+    __m256i blank = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, newline)),
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, carriage), _mm256_cmpeq_epi8(v, tab)));
+    uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(blank);
+    if (mask != 0)
+      return ptr + trailing_zeros(mask);
+  }
 #endif
-{
+#if defined(JSONHEAD_AVX2) || defined(JSONHEAD_SSE2)
+  const __m128i space16 = _mm_set1_epi8(' ');
+  const __m128i newline16 = _mm_set1_epi8('\n');
+  const __m128i carriage16 = _mm_set1_epi8('\r');
+  const __m128i tab16 = _mm_set1_epi8('\t');
+  for (; ptr + 16 <= end; ptr += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)ptr);
+    __m128i blank = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, space16), _mm_cmpeq_epi8(v, newline16)),
+      _mm_or_si128(_mm_cmpeq_epi8(v, carriage16), _mm_cmpeq_epi8(v, tab16)));
+    uint32_t mask = ~(uint32_t)_mm_movemask_epi8(blank) & 0xffff;
+    if (mask != 0)
+      return ptr + trailing_zeros(mask);
+  }
+#endif
+  for (; ptr < end; ptr++)
+    if (*ptr != ' ' && *ptr != '\n' && *ptr != '\r' && *ptr != '\t')
+      return ptr;
+  return end;
 }
 
-bool jsonhead::json_parser::step() {
-  if (!_reduce && !lex.next()) return false;
-   
-  _reduce = false;
+static int hex_value(char ch) {
+  if ('0' <= ch && ch <= '9') return ch - '0';
+  if ('a' <= ch && ch <= 'f') return ch - 'a' + 10;
+  if ('A' <= ch && ch <= 'F') return ch - 'A' + 10;
+  return -1;
+}
 
-  if (stack.empty())
-    stack.push(0);
+static bool read_hex4(const char *ptr, const char *end, uint32_t& code) {
+  if (end - ptr < 4)
+    return false;
+  code = 0;
+  for (int i = 0; i < 4; i++) {
+    int v = hex_value(ptr[i]);
+    if (v < 0)
+      return false;
+    code = code << 4 | v;
+  }
+  return true;
+}
+
+static char *write_utf8(char *out, uint32_t code) {
+  if (code < 0x80) {
+    *out++ = (char)code;
+  }
+  else if (code < 0x800) {
+    *out++ = (char)(0xc0 | code >> 6);
+    *out++ = (char)(0x80 | (code & 0x3f));
+  }
+  else if (code < 0x10000) {
+    *out++ = (char)(0xe0 | code >> 12);
+    *out++ = (char)(0x80 | (code >> 6 & 0x3f));
+    *out++ = (char)(0x80 | (code & 0x3f));
+  }
+  else {
+    *out++ = (char)(0xf0 | code >> 18);
+    *out++ = (char)(0x80 | (code >> 12 & 0x3f));
+    *out++ = (char)(0x80 | (code >> 6 & 0x3f));
+    *out++ = (char)(0x80 | (code & 0x3f));
+  }
+  return out;
+}
+
+jsonhead::String jsonhead::json_unescape(const char *ptr, size_t len) {
+  // Decoded text is never longer than its escaped form.
+  char *result = new char[len + 1];
+  size_t length = json_unescape(result, ptr, len);
+  result[length] = 0;
+  return String(result, length, false);
+}
 
-  bool require_reduce = false;
-  int code = goto_table[stack.top()][(int)lex.type()];
+size_t jsonhead::json_unescape(char *result, const char *ptr, size_t len) {
+  char *out = result;
+  const char *end = ptr + len;
 
-  if (code == ACCEPT_INDEX)
-  {
-    // End of json format
-    _entry = values.top();
-    values.pop();
+  while (ptr < end) {
+    const char *escape = (const char *)memchr(ptr, '\\', end - ptr);
+    if (escape == nullptr)
+      escape = end;
+    memcpy(out, ptr, escape - ptr);
+    out += escape - ptr;
+    ptr = escape;
+    if (ptr == end || ptr + 1 == end)
+      break;
+
+    char ch = ptr[1];
+    ptr += 2;
+    switch (ch)
+    {
+    case 'b': *out++ = '\b'; break;
+    case 'f': *out++ = '\f'; break;
+    case 'n': *out++ = '\n'; break;
+    case 'r': *out++ = '\r'; break;
+    case 't': *out++ = '\t'; break;
+    case 'u':
+      {
+        uint32_t code;
+        if (!read_hex4(ptr, end, code)) {
+          // Malformed escape is kept as it is.
+          *out++ = '\\';
+          *out++ = 'u';
+          break;
+        }
+        ptr += 4;
+        if (0xd800 <= code && code < 0xdc00) {
+          uint32_t low;
+          if (end - ptr >= 6 && ptr[0] == '\\' && ptr[1] == 'u' &&
+              read_hex4(ptr + 2, end, low) && 0xdc00 <= low && low < 0xe000) {
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            ptr += 6;
+          }
+        }
+        out = write_utf8(out, code);
+      }
+      break;
+    default:
+      // '"', '\\', '/' and anything unknown stand for themselves.
+      *out++ = ch;
+      break;
+    }
+  }
+
+  return out - result;
+}
+
+static inline bool is_eight_digits(const char *ptr) {
+  uint64_t val;
+  memcpy(&val, ptr, 8);
+  return (((val & 0xF0F0F0F0F0F0F0F0ULL) |
+           (((val + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+          0x3333333333333333ULL);
+}
+
+// Little-endian, the first digit is in the lowest byte.
+static inline uint32_t parse_eight_digits(const char *ptr) {
+  uint64_t val;
+  memcpy(&val, ptr, 8);
+  val = (val & 0x0F0F0F0F0F0F0F0FULL) * 2561 >> 8;
+  val = (val & 0x00FF00FF00FF00FFULL) * 6553601 >> 16;
+  return (uint32_t)((val & 0x0000FFFF0000FFFFULL) * 42949672960001ULL >> 32);
+}
+
+// Accumulate digits of [ptr, end) into mantissa, 19 digits at most.
+// Returns the end of the digit run and counts every digit seen.
+static const char *parse_digits(const char *ptr, const char *end,
+                                uint64_t& mantissa, int& digits) {
+  while (end - ptr >= 8 && digits + 8 <= 19 && is_eight_digits(ptr)) {
+    mantissa = mantissa * 100000000 + parse_eight_digits(ptr);
+    digits += 8;
+    ptr += 8;
+  }
+  for (; ptr < end && isdigit((unsigned char)*ptr); ptr++, digits++)
+    if (digits < 19)
+      mantissa = mantissa * 10 + (*ptr - '0');
+  return ptr;
+}
+
+static double slow_parse_double(const char *ptr, size_t len) {
+  char local[64];
+  std::unique_ptr<char[]> heap;
+  char *text = local;
+  if (len >= sizeof(local)) {
+    heap.reset(new char[len + 1]);
+    text = heap.get();
+  }
+  memcpy(text, ptr, len);
+  text[len] = 0;
+  return strtod(text, nullptr);
+}
+
+bool jsonhead::json_parse_number(const char *ptr, size_t len, json_number& number) {
+  static const double power_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+
+  const char *start = ptr;
+  const char *end = ptr + len;
+  bool negative = ptr < end && *ptr == '-';
+  if (negative)
+    ptr++;
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  const char *int_end = parse_digits(ptr, end, mantissa, digits);
+  if (int_end == ptr)
     return false;
+  int int_digits = digits;
+  ptr = int_end;
+
+  long long exponent = 0;
+  bool is_float = false;
+
+  if (ptr < end && *ptr == '.') {
+    is_float = true;
+    const char *frac = ++ptr;
+    ptr = parse_digits(ptr, end, mantissa, digits);
+    if (ptr == frac)
+      return false;
+    // Only the digits that made it into the mantissa shift it.
+    exponent -= std::min(digits, 19) - std::min(int_digits, 19);
   }
-  else if (code > 0)
+
+  if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+    is_float = true;
+    ptr++;
+    bool negative_exp = false;
+    if (ptr < end && (*ptr == '+' || *ptr == '-'))
+      negative_exp = *ptr++ == '-';
+    if (ptr == end || !isdigit((unsigned char)*ptr))
+      return false;
+    long long exp = 0;
+    for (; ptr < end && isdigit((unsigned char)*ptr); ptr++)
+      if (exp < 100000)
+        exp = exp * 10 + (*ptr - '0');
+    exponent += negative_exp ? -exp : exp;
+  }
+
+  if (ptr != end)
+    return false;
+
+  if (!is_float && digits == 20) {
+    // The last digit did not make it into the mantissa, add it unless
+    // the sum is above UINT64_MAX.
+    uint64_t last = int_end[-1] - '0';
+    if (mantissa <= (UINT64_MAX - last) / 10) {
+      mantissa = mantissa * 10 + last;
+      digits = 19;
+    }
+    else
+      mantissa = 0;
+  }
+
+  if (!is_float && digits <= 19) {
+    // Integer digits dropped beyond 19 never happen here, so the
+    // mantissa is exact.
+    if (!negative && mantissa <= (uint64_t)INT64_MAX) {
+      number.type = json_number_type::integer;
+      number.i = (int64_t)mantissa;
+      return true;
+    }
+    if (!negative) {
+      number.type = json_number_type::unsigned_integer;
+      number.u = mantissa;
+      return true;
+    }
+    if (mantissa <= (uint64_t)INT64_MAX + 1) {
+      number.type = json_number_type::integer;
+      number.i = (int64_t)(0 - mantissa);
+      return true;
+    }
+  }
+
+  number.type = json_number_type::floating;
+
+  // Clinger's fast path: both the mantissa and 10^|exponent| are exact
+  // doubles, so a single multiplication or division rounds correctly.
+  if (digits <= 19 && mantissa <= (1ULL << 53) &&
+      -22 <= exponent && exponent <= 22) {
+    double value = (double)mantissa;
+    if (exponent < 0)
+      value /= power_of_ten[-exponent];
+    else
+      value *= power_of_ten[exponent];
+    number.d = negative ? -value : value;
+    return true;
+  }
+
+  number.d = slow_parse_double(start, len);
+  return true;
+}
+
+int64_t jsonhead::json_number::to_int64() const {
+  switch (type)
   {
-    // Shift
-    stack.push(code);
-    contents.push(lex.str());
+  case json_number_type::integer: return i;
+  case json_number_type::unsigned_integer: return (int64_t)u;
+  default: return (int64_t)d;
   }
-  else if (code < 0)
+}
+
+uint64_t jsonhead::json_number::to_uint64() const {
+  switch (type)
   {
-    // Reduce
-    reduce(code);
-    _reduce = true;
+  case json_number_type::integer: return (uint64_t)i;
+  case json_number_type::unsigned_integer: return u;
+  default: return (uint64_t)d;
   }
-  else
+}
+
+double jsonhead::json_number::to_double() const {
+  switch (type)
   {
-    // Panic mode
-    this->_error = true;
-    return false;
+  case json_number_type::integer: return (double)i;
+  case json_number_type::unsigned_integer: return (double)u;
+  default: return d;
   }
+}
 
-  return true;
+bool jsonhead::json_number::finite() const {
+  return type != json_number_type::floating || std::isfinite(d);
 }
 
-void jsonhead::json_parser::reduce(int code) {
-  int reduce_production = -code;
+///===-----------------------------------------------------------------------===
+///
+///               Json Source
+///
+///===-----------------------------------------------------------------------===
 
-  // Reduce Stack
-  for (int i = 0; i < production[reduce_production]; i++) {
-    stack.pop();
+jsonhead::json_file_source::json_file_source(const std::string& file_path)
+  : ifs(file_path, std::ios::binary) {
+  ifs.seekg(0, std::ios::end);
+  file_size = ifs.tellg();
+  ifs.seekg(0, std::ios::beg);
+
+  if (!ifs)
+    throw std::runtime_error("file not found!");
+}
+
+long long jsonhead::json_file_source::read(char *buffer, long long size) {
+  long long count = ifs.read(buffer, size).gcount();
+  consumed_size += count;
+  return count;
+}
+
+jsonhead::json_mmap_source::json_mmap_source(const std::string& file_path) {
+#ifdef _OS_WINDOWS
+  file_handle = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+    nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file_handle == INVALID_HANDLE_VALUE) {
+    file_handle = nullptr;
+    throw std::runtime_error("file not found!");
   }
 
-  stack.push(goto_table[stack.top()][group_table[reduce_production]]);
+  LARGE_INTEGER size;
+  GetFileSizeEx(file_handle, &size);
+  file_size = size.QuadPart;
 
-  //   0:         S' -> JSON
-  //   1:       JSON -> OBJECT
-  //   2:       JSON -> ARRAY
-  //   3:      ARRAY -> [ ]
-  //   4:      ARRAY -> [ ELEMENTS ]
-  //   5:     OBJECT -> { }
-  //   6:     OBJECT -> { MEMBERS }
-  //   7:    MEMBERS -> PAIR
-  //   8:    MEMBERS -> PAIR , MEMBERS
-  //   9:       PAIR -> v_string : VALUE
-  //  10:   ELEMENTS -> VALUE
-  //  11:   ELEMENTS -> VALUE , ELEMENTS
-  //  12:      VALUE -> v_string
-  //  13:      VALUE -> v_number
-  //  14:      VALUE -> OBJECT
-  //  15:      VALUE -> ARRAY
-  //  16:      VALUE -> true
-  //  17:      VALUE -> false
-  //  18:      VALUE -> null
+  if (file_size > 0) {
+    map_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (map_handle != nullptr)
+      map = (char *)MapViewOfFile(map_handle, FILE_MAP_READ, 0, 0, 0);
+    if (map == nullptr) {
+      unmap();
+      throw std::runtime_error("memory mapping failed!");
+    }
+  }
+#else
+  int fd = open(file_path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("file not found!");
 
-  switch (reduce_production)
-  {
-  //case 0:
-  //case 1:
-  //case 2:
+  struct stat st;
+  fstat(fd, &st);
+  file_size = st.st_size;
 
-  case 3:
-    contents.pop();
-    contents.pop();
-#ifndef CONFIG_ALLOCATOR
-    values.push(jarray(new json_array));
+  if (file_size > 0) {
+    void *ptr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+      throw std::runtime_error("memory mapping failed!");
+    madvise(ptr, file_size, MADV_SEQUENTIAL);
+    map = (char *)ptr;
+  }
+  else
+    close(fd);
+#endif
+}
+
+jsonhead::json_mmap_source::~json_mmap_source() {
+  unmap();
+}
+
+void jsonhead::json_mmap_source::unmap() {
+#ifdef _OS_WINDOWS
+  if (map != nullptr)
+    UnmapViewOfFile(map);
+  if (map_handle != nullptr)
+    CloseHandle(map_handle);
+  if (file_handle != nullptr)
+    CloseHandle(file_handle);
+  map_handle = file_handle = nullptr;
 #else
-    values.push(jarray(jarray_pool.allocate()));
+  if (map != nullptr)
+    munmap(map, file_size);
 #endif
-    break;
+  map = nullptr;
+}
+
+long long jsonhead::json_mmap_source::read(char *buffer, long long size) {
+  long long count = std::min(size, file_size - consumed_size);
+  if (count > 0)
+    memcpy(buffer, map + consumed_size, count);
+  consumed_size += count;
+  return count;
+}
+
+jsonhead::json_memory_source::json_memory_source(const char *ptr, size_t length)
+  : ptr(ptr), length(length) {
+}
+
+long long jsonhead::json_memory_source::read(char *buffer, long long size) {
+  long long count = std::min(size, length - consumed_size);
+  if (count > 0)
+    memcpy(buffer, ptr + consumed_size, count);
+  consumed_size += count;
+  return count;
+}
+
+jsonhead::json_fd_source::json_fd_source(int fd, bool close_on_destroy)
+  : fd(fd), owns(close_on_destroy) {
+  if (fd < 0)
+    throw std::runtime_error("invalid file descriptor!");
+}
+
+jsonhead::json_fd_source::~json_fd_source() {
+  if (owns)
+    _close(fd);
+}
+
+long long jsonhead::json_fd_source::read(char *buffer, long long size) {
+  // Pipes return whatever is available, keep reading until the request is
+  // complete or the writer closed its end.
+  long long count = 0;
+  while (count < size) {
+    unsigned chunk = (unsigned)std::min<long long>(size - count, 1 << 30);
+    auto result = _read(fd, buffer + count, chunk);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0)
+      break;
+    count += result;
+  }
+  consumed_size += count;
+  return count;
+}
+
+#ifdef CONFIG_GZIP
+jsonhead::json_gzip_source::json_gzip_source(const std::string& file_path) {
+  struct stat st;
+  if (stat(file_path.c_str(), &st) == 0)
+    compressed_size = st.st_size;
+
+  file = gzopen(file_path.c_str(), "rb");
+  if (file == nullptr)
+    throw std::runtime_error("file not found!");
+  gzbuffer((gzFile)file, 1024 * 1024);
+}
+
+jsonhead::json_gzip_source::json_gzip_source(int fd) {
+  file = gzdopen(fd, "rb");
+  if (file == nullptr)
+    throw std::runtime_error("invalid file descriptor!");
+  gzbuffer((gzFile)file, 1024 * 1024);
+}
+
+jsonhead::json_gzip_source::~json_gzip_source() {
+  gzclose((gzFile)file);
+}
+
+long long jsonhead::json_gzip_source::read(char *buffer, long long size) {
+  long long count = 0;
+  while (count < size) {
+    unsigned chunk = (unsigned)std::min<long long>(size - count, 1 << 30);
+    int result = gzread((gzFile)file, buffer + count, chunk);
+    if (result <= 0)
+      break;
+    count += result;
+  }
+  consumed_size = gzoffset((gzFile)file);
+  return count;
+}
+#endif
+
+jsonhead::json_readahead::json_readahead(json_source& source, long long block_size,
+                                         long long headroom, int count)
+  : source(source), block_size(block_size), headroom(headroom), blocks(std::max(count, 2)) {
+  for (auto& b : blocks)
+    b.memory.reset(new char[headroom + block_size]);
+  worker = std::thread(&json_readahead::run, this);
+}
+
+jsonhead::json_readahead::~json_readahead() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cv.notify_all();
+  worker.join();
+}
+
+char *jsonhead::json_readahead::acquire(long long& size) {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&] { return acquired < filled || finished; });
+  if (acquired == filled)
+    return nullptr;
+  auto& b = blocks[acquired++ % blocks.size()];
+  size = b.size;
+  return b.memory.get() + headroom;
+}
+
+void jsonhead::json_readahead::release() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    released++;
+  }
+  cv.notify_all();
+}
+
+void jsonhead::json_readahead::run() {
+  while (true) {
+    block *b;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return stopping || filled - released < (long long)blocks.size(); });
+      if (stopping)
+        return;
+      b = &blocks[filled % blocks.size()];
+    }
+
+    // Read without holding the lock, the lexer keeps working meanwhile.
+    b->size = source.read(b->memory.get() + headroom, block_size);
+
+    bool last = b->size < block_size;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      filled++;
+      finished = last;
+    }
+    cv.notify_all();
+    if (last)
+      return;
+  }
+}
+
+static std::unique_ptr<jsonhead::json_source> open_source(const std::string& file_path,
+                                                           jsonhead::json_input_mode mode) {
+  using namespace jsonhead;
+  if (mode == json_input_mode::memory_map)
+    return std::unique_ptr<json_source>(new json_mmap_source(file_path));
+  return std::unique_ptr<json_source>(new json_file_source(file_path));
+}
+
+jsonhead::json_lexer::json_lexer(std::string file_path, long long buffer_size,
+                                 json_input_mode mode) 
+  : json_lexer(open_source(file_path, mode), buffer_size, 
+               mode == json_input_mode::read_ahead) {
+}
+
+jsonhead::json_lexer::json_lexer(std::unique_ptr<json_source> src, long long buffer_size,
+                                 bool read_ahead)
+  : curtok(json_token::none), buffer_size(buffer_size), source(std::move(src)) {
+  file_size = source->size();
+
+  if (source->data() != nullptr) {
+    // The whole input is a single block which has been read at once,
+    // so position() keeps working without any special case.
+    in_memory = true;
+    buffer = pointer = (char *)source->data();
+    read_size = current_block_size = file_size;
+    return;
+  }
+
+  if (read_ahead)
+    readahead.reset(new json_readahead(*source, buffer_size, 
+                                       std::max(buffer_size / 8, 4096LL)));
+  else
+    buffer = new char[buffer_size];
+}
+
+jsonhead::json_lexer::json_lexer()
+  : curtok(json_token::none), file_size(-1), buffer_size(0), 
+    input_end(true), pushing(true) {
+}
+
+jsonhead::json_lexer::~json_lexer() {
+  // Stop the reader before the source goes away.
+  if (readahead)
+    readahead.reset();
+  else if (!in_memory && !pushing)
+    delete[] buffer;
+}
+
+void jsonhead::json_lexer::feed(const char *ptr, size_t len) {
+  rest = nullptr;
+  if (pending.empty()) {
+    push_block(ptr, len);
+    return;
+  }
+
+  // Bytes of the chunk up to the end of the unfinished token, or up to
+  // the byte after a number or keyword.
+  size_t take = 0;
+  bool done = false;
+  if (pending[0] == '"') {
+    size_t run = 0;
+    for (size_t i = pending.size() - 1; i > 0 && pending[i] == '\\'; i--)
+      run++;
+    take = run & 1;
+    while (take < len) {
+      const char *p = json_scan_string(ptr + take, ptr + len);
+      if (p == ptr + len)
+        break;
+      take = p - ptr + 1;
+      if (*p == '"') {
+        done = true;
+        break;
+      }
+      if (*p == '\\')
+        take++;
+    }
+  }
+  else {
+    for (; take < len; take++) {
+      char ch = ptr[take];
+      if (!isalnum((unsigned char)ch) && ch != '+' && ch != '-' && ch != '.') {
+        take++;
+        done = true;
+        break;
+      }
+    }
+  }
+
+  if (!done) {
+    // The token goes on, nothing can be lexed yet.
+    pending.insert(pending.end(), ptr, ptr + len);
+    read_size += len;
+    buffer = pointer = nullptr;
+    current_block_size = 0;
+    return;
+  }
+  pending.insert(pending.end(), ptr, ptr + take);
+  read_size -= pending.size() - take;
+  push_block(pending.data(), pending.size());
+  rest = ptr + take;
+  rest_size = len - take;
+}
+
+void jsonhead::json_lexer::finish() {
+  push_finished = true;
+  rest = nullptr;
+  if (!pending.empty()) {
+    read_size -= pending.size();
+    push_block(pending.data(), pending.size());
+  }
+}
+
+void jsonhead::json_lexer::push_block(const char *ptr, size_t len) {
+  buffer = pointer = (char *)ptr;
+  current_block_size = len;
+  read_size += len;
+  exhausted = false;
+}
+
+bool jsonhead::json_lexer::push_next() {
+  while (true) {
+    char *start = pointer;
+    bool result = lex_token();
+    if (!starved)
+      return result;
+    starved = false;
+
+    if (rest != nullptr) {
+      // The pending token is done, go on with the chunk.
+      push_block(rest, rest_size);
+      rest = nullptr;
+      continue;
+    }
+
+    // Keep the unfinished token for the next chunk.
+    if (start != nullptr) {
+      char *end = buffer + current_block_size;
+      while (start < end && (*start == ' ' || *start == '\r' || *start == '\n' || *start == '\t'))
+        start++;
+      if (buffer == pending.data())
+        pending.erase(pending.begin(), pending.begin() + (start - buffer));
+      else
+        pending.assign(start, end);
+      buffer = pointer = nullptr;
+      current_block_size = 0;
+    }
+    curtok = json_token::none;
+    token_begin = nullptr;
+    token_size = 0;
+    return true;
+  }
+}
+
+bool jsonhead::json_lexer::next() {
+  if (enclose_open) {
+    enclose_open = false;
+    curtok = json_token::array_starts;
+    token_begin = nullptr;
+    token_size = 0;
+    return true;
+  }
+  bool result = pushing ? push_next() : lex_token();
+  if (result && curtok == json_token::eof && enclose_close) {
+    enclose_close = false;
+    curtok = json_token::array_ends;
+  }
+  // Pushed whitespace before a token may end in an earlier chunk.
+  if (curtok != json_token::none) {
+    _line_break = newline_seen;
+    newline_seen = false;
+  }
+  return result;
+}
+
+long long jsonhead::json_lexer::token_position() const {
+  if (curtok == json_token::eof || curtok == json_token::none)
+    return position();
+  const char *begin = pointer - 1;
+  if (token_begin != nullptr)
+    begin = curtok == json_token::v_string ? token_begin - 1 : token_begin;
+  return read_size - current_block_size + (begin - buffer);
+}
+
+bool jsonhead::json_lexer::strict_error(const char *ptr) {
+  _error_position = read_size - current_block_size + (ptr - buffer);
+  return false;
+}
+
+bool jsonhead::json_lexer::lex_token() {
+  // Left as is when the token is invalid.
+  curtok = json_token::error;
+  _error_position = -1;
+  token_begin = nullptr;
+  token_size = 0;
+  token_escape = false;
+  token_skip = false;
+  if (_structural && !seek_structural()) {
+    curtok = json_token::eof;
+    return true;
+  }
+  while (true) {
+    // A NUL byte is not the end, it falls through to an invalid number.
+    auto cur = next_ch();
+    if (cur == 0 && exhausted) {
+      curtok = json_token::eof;
+      return true;
+    }
+
+    switch (cur)
+    {
+    case ' ':
+    case '\r':
+    case '\n':
+    case '\t':
+      {
+        // Indentation comes in runs, the rest of the block is skipped at once.
+        const char *start = pointer - 1;
+        pointer = (char *)json_skip_whitespace(pointer, buffer + current_block_size);
+        if (_track_lines && !newline_seen)
+          newline_seen = memchr(start, '\n', pointer - start) != nullptr;
+      }
+      continue;
+
+    case ',':
+      this->curtok = json_token::v_comma;
+      break;
+
+    case ':':
+      this->curtok = json_token::v_pair;
+      break;
+
+    case '{':
+      this->curtok = json_token::object_starts;
+      break;
+
+    case '}':
+      this->curtok = json_token::object_ends;
+      break;
+
+    case '[':
+      this->curtok = json_token::array_starts;
+      break;
+
+    case ']':
+      this->curtok = json_token::array_ends;
+      break;
+
+    case 't':
+    case 'f':
+    case 'n':
+      {
+        token_begin = pointer - 1;
+        while (cur && isalpha(cur))
+          cur = next_ch();
+        if (cur || !exhausted) prev();
+        token_size = pointer - token_begin;
+
+        if (token_size == 4 && !memcmp(token_begin, "true", 4))
+          this->curtok = json_token::v_true;
+        else if (token_size == 5 && !memcmp(token_begin, "false", 5))
+          this->curtok = json_token::v_false;
+        else if (token_size == 4 && !memcmp(token_begin, "null", 4))
+          this->curtok = json_token::v_null;
+        else
+          return false;
+      }
+      return true;
+
+    case '"':
+      {
+        curtok = json_token::v_string;
+        token_begin = pointer;
+        token_escape = false;
+
+        // Skip the plain span at once, only quotes and escapes stop here.
+        while (true)
+        {
+          pointer = (char *)json_scan_string(pointer, buffer + current_block_size);
+          // Refills when the span ran up to the end of the buffer.
+          if (!(cur = next_ch()) && exhausted)
+            return false;
+          if (cur == '"') break;
+          if (cur == '\\') {
+            token_escape = true;
+            if (!next_ch() && exhausted)
+              return false;
+          }
+        }
+
+        token_size = pointer - 1 - token_begin;
+        if (_strict) {
+          const char *invalid = json_check_string(token_begin, token_begin + token_size);
+          if (invalid != nullptr)
+            return strict_error(invalid);
+        }
+      }
+      return true;
+
+    default:
+      {
+        token_begin = pointer - 1;
+        bool digits = false;
+
+        if (cur == '-')
+          cur = next_ch();
+
+        // [0-9]+
+        while (cur && isdigit(cur)) {
+          digits = true;
+          cur = next_ch();
+        }
+        
+        if (!digits)
+          return false;
+        
+        // [0-9]+.[0-9]+
+        if (cur && cur == '.') {
+          cur = next_ch();
+          if (!cur || !isdigit(cur))
+            return false;
+          
+          while (cur && isdigit(cur))
+            cur = next_ch();
+        }
+        
+        // [0-9]+[Ee][+-]?[0-9]+
+        // [0-9]+.[0-9]+[Ee][+-]?[0-9]+
+        if (cur && (cur == 'E' || cur == 'e')) {
+          cur = next_ch();
+          
+          if (!cur || !(cur == '+' || cur == '-' || isdigit(cur)))
+            return false;
+          
+          if (cur == '+' || cur == '-')
+            cur = next_ch();
+          
+          if (!cur || !isdigit(cur))
+            return false;
+          
+          while (cur && isdigit(cur))
+            cur = next_ch();
+        }
+        if (cur || !exhausted) prev();
+
+        curtok = json_token::v_number;
+        token_size = pointer - token_begin;
+        if (_strict) {
+          // A zero is the whole integer part when it leads.
+          const char *integer = token_begin + (*token_begin == '-');
+          if (integer[0] == '0' && token_size > (size_t)(integer + 1 - token_begin) && 
+              isdigit((unsigned char)integer[1]))
+            return strict_error(integer + 1);
+        }
+        if (_decode_numbers && !json_parse_number(token_begin, token_size, token_number))
+          return false;
+      }
+      return true;
+    }
+
+    token_begin = pointer - 1;
+    token_size = 1;
+    return true;
+  }
+}
+
+bool jsonhead::json_lexer::skip_value(bool containers) {
+  if (!next())
+    return false;
+
+  switch (curtok)
+  {
+  case json_token::v_string:
+  case json_token::v_number:
+  case json_token::v_true:
+  case json_token::v_false:
+  case json_token::v_null:
+    break;
+
+  case json_token::object_starts:
+  case json_token::array_starts:
+    if (!containers)
+      return true;
+    {
+      // Nothing of the skipped value is carried into the next buffer.
+      token_begin = nullptr;
+      size_t depth = 1;
+      while (depth > 0) {
+        char cur;
+        if (_structural) {
+          // Brackets inside strings are not in the index.
+          if (!seek_structural()) {
+            curtok = json_token::eof;
+            return true;
+          }
+          cur = *pointer++;
+        }
+        else if ((cur = next_ch()) == '"') {
+          while (true) {
+            pointer = (char *)json_scan_string(pointer, buffer + current_block_size);
+            if ((!(cur = next_ch()) && exhausted) || cur == '"')
+              break;
+            if (cur == '\\' && !(cur = next_ch()) && exhausted)
+              break;
+          }
+        }
+
+        if (cur == 0 && exhausted) {
+          curtok = json_token::eof;
+          return true;
+        }
+        if (cur == '{' || cur == '[')
+          depth++;
+        else if (cur == '}' || cur == ']')
+          depth--;
+      }
+    }
+    break;
+
+  default:
+    return true;
+  }
+
+  curtok = json_token::v_null;
+  token_begin = nullptr;
+  token_size = 0;
+  token_escape = false;
+  token_skip = true;
+  return true;
+}
+
+const char *jsonhead::json_lexer::gbuffer() const {
+  return pointer;
+}
+
+inline void jsonhead::json_lexer::buffer_refresh() {
+  // Keep the bytes of the token being lexed at the front of the buffer,
+  // so token() is always contiguous.
+  long long carry = 0;
+  if (token_begin != nullptr)
+    carry = buffer + current_block_size - token_begin;
+
+  long long fresh = readahead ? readahead_refresh(carry) : stream_refresh(carry);
+
+  if (token_begin != nullptr)
+    token_begin = buffer;
+  current_block_size = carry + fresh;
+  read_size += fresh;
+  pointer = buffer + carry;
+
+  if (_structural) {
+    index.index(pointer, fresh);
+    index_base = pointer;
+    index_end = buffer + current_block_size;
+    index_cursor = 0;
+  }
+}
+
+long long jsonhead::json_lexer::stream_refresh(long long carry) {
+  if (carry == buffer_size) {
+    char *grow = new char[buffer_size * 2];
+    memcpy(grow, token_begin, carry);
+    delete[] buffer;
+    buffer = grow;
+    buffer_size *= 2;
+  }
+  else if (carry > 0)
+    memmove(buffer, token_begin, carry);
+
+  long long request = buffer_size - carry;
+  long long fresh = source->read(buffer + carry, request);
+  if (fresh < request)
+    input_end = true;
+  return fresh;
+}
+
+long long jsonhead::json_lexer::readahead_refresh(long long carry) {
+  long long fresh = 0;
+  char *data = readahead->acquire(fresh);
+
+  if (data == nullptr) {
+    // Nothing left, the unfinished token stays where it is.
+    input_end = true;
+    if (carry > 0)
+      buffer = token_begin;
+    return 0;
+  }
+  if (fresh < readahead->capacity())
+    input_end = true;
+
+  char *next;
+  bool hold = true;
+  if (carry <= readahead->reserved()) {
+    next = data - carry;
+    if (carry > 0)
+      memcpy(next, token_begin, carry);
+  }
+  else {
+    std::vector<char> grow(carry + fresh);
+    memcpy(grow.data(), token_begin, carry);
+    memcpy(grow.data() + carry, data, fresh);
+    spill.swap(grow);
+    next = spill.data();
+    hold = false;
+  }
+
+  // Blocks are released in the order they were acquired.
+  if (holding_block)
+    readahead->release();
+  if (!hold)
+    readahead->release();
+  holding_block = hold;
+
+  buffer = next;
+  return fresh;
+}
+
+bool jsonhead::json_lexer::seek_structural() {
+  while (true) {
+    for (; index_cursor < index.size(); index_cursor++) {
+      char *next = index_base + index[index_cursor];
+      // A token that crossed a window boundary may have consumed
+      // positions of the next window already.
+      if (next >= pointer) {
+        if (_track_lines && !newline_seen && pointer != nullptr)
+          newline_seen = memchr(pointer, '\n', next - pointer) != nullptr;
+        pointer = next;
+        index_cursor++;
+        return true;
+      }
+    }
+
+    if (in_memory) {
+      // Index the input window by window to bound the index size.
+      if (index_end == nullptr)
+        index_end = buffer;
+      char *last = buffer + file_size;
+      if (index_end == last)
+        return false;
+      size_t window = (size_t)std::min<long long>(buffer_size, last - index_end);
+      if (_index_threads > 1) {
+        // Windows of a batch are shorter, a batch covers one buffer size.
+        window = std::max<size_t>(buffer_size / _index_threads, 64 * 1024);
+        if (index_window == index_windows.size()) {
+          size_t batch = std::min<size_t>(window * _index_threads, last - index_end);
+          index.index_parallel(buffer, index_end, batch, window, index_windows);
+          index_window = 0;
+        }
+        index.swap(index_windows[index_window++]);
+        window = std::min<size_t>(window, last - index_end);
+      }
+      else
+        index.index(index_end, window);
+      index_base = index_end;
+      index_end += window;
+      index_cursor = 0;
+    }
+    else {
+      if (pointer != nullptr) {
+        char *end = buffer + current_block_size;
+        if (_track_lines && !newline_seen)
+          newline_seen = memchr(pointer, '\n', end - pointer) != nullptr;
+        pointer = end;
+      }
+      if (pointer != nullptr && input_end)
+        return false;
+      buffer_refresh();
+      if (current_block_size == 0)
+        return false;
+    }
+  }
+}
+
+inline bool jsonhead::json_lexer::require_refresh() {
+  return pointer == nullptr || buffer + current_block_size == pointer;
+}
+
+char jsonhead::json_lexer::next_ch() {
+  if (require_refresh()) {
+    if (in_memory || input_end) {
+      // Pushed input may go on in the next chunk.
+      starved = pushing && !push_finished;
+      exhausted = true;
+      return (char)0;
+    }
+    buffer_refresh();
+    if (require_refresh()) {
+      exhausted = true;
+      return (char)0;
+    }
+  }
+  return *pointer++;
+}
+
+void jsonhead::json_lexer::prev() {
+  pointer--;
+}
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Writer
+///
+///===-----------------------------------------------------------------------===
+
+jsonhead::json_writer::json_writer(std::ostream& os, size_t buffer_size)
+  : os(&os), capacity(std::max(buffer_size, (size_t)64)), buffer(new char[capacity]) {
+}
+
+jsonhead::json_writer::json_writer(int fd, size_t buffer_size)
+  : fd(fd), capacity(std::max(buffer_size, (size_t)64)), buffer(new char[capacity]) {
+  if (fd < 0)
+    throw std::runtime_error("invalid file descriptor!");
+}
+
+jsonhead::json_writer::json_writer(const std::string& file_path, size_t buffer_size)
+  : owns(true), capacity(std::max(buffer_size, (size_t)64)), buffer(new char[capacity]) {
+#ifdef _OS_WINDOWS
+  fd = _open(file_path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+  fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+  if (fd < 0)
+    throw std::runtime_error("cannot create file!");
+}
+
+jsonhead::json_writer::~json_writer() {
+  flush();
+  if (owns)
+    _close(fd);
+}
+
+void jsonhead::json_writer::indent(const std::string& unit, const std::string& prefix) {
+  _indent = unit;
+  indents = prefix;
+  this->prefix = prefix.length();
+}
+
+void jsonhead::json_writer::put(const char *ptr, size_t len) {
+  if (size + len > capacity) {
+    flush();
+    // Long strings go out as they are.
+    if (len > capacity) {
+      write_out(ptr, len);
+      return;
+    }
+  }
+  memcpy(buffer.get() + size, ptr, len);
+  size += len;
+}
+
+void jsonhead::json_writer::newline(size_t depth) {
+  size_t length = prefix + depth * _indent.length();
+  while (indents.length() < length)
+    indents += _indent;
+  put('\n');
+  put(indents.data(), length);
+}
+
+// Returns the first '"', '\\' or control character in [ptr, end).
+static const char *scan_escape(const char *ptr, const char *end) {
+#if defined(JSONHEAD_AVX2)
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  for (; ptr + 32 <= end; ptr += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)ptr);
+    __m256i special = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+      _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(special);
+    if (mask != 0)
+      return ptr + trailing_zeros(mask);
+  }
+#endif
+#if defined(JSONHEAD_AVX2) || defined(JSONHEAD_SSE2)
+  const __m128i quote16 = _mm_set1_epi8('"');
+  const __m128i backslash16 = _mm_set1_epi8('\\');
+  const __m128i control16 = _mm_set1_epi8(0x1f);
+  for (; ptr + 16 <= end; ptr += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)ptr);
+    __m128i special = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, quote16), _mm_cmpeq_epi8(v, backslash16)),
+      _mm_cmpeq_epi8(_mm_min_epu8(v, control16), v));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(special);
+    if (mask != 0)
+      return ptr + trailing_zeros(mask);
+  }
+#endif
+  for (; ptr < end; ptr++)
+    if (*ptr == '"' || *ptr == '\\' || (unsigned char)*ptr < 0x20)
+      return ptr;
+  return end;
+}
+
+void jsonhead::json_writer::string(const char *ptr, size_t len) {
+  const char *end = ptr + len;
+  put('"');
+  while (true) {
+    const char *special = scan_escape(ptr, end);
+    put(ptr, special - ptr);
+    if (special == end)
+      break;
+    unsigned char ch = *special;
+    switch (ch)
+    {
+    case '"': put("\\\"", 2); break;
+    case '\\': put("\\\\", 2); break;
+    case '\b': put("\\b", 2); break;
+    case '\f': put("\\f", 2); break;
+    case '\n': put("\\n", 2); break;
+    case '\r': put("\\r", 2); break;
+    case '\t': put("\\t", 2); break;
+    default:
+      {
+        const char *hex = "0123456789abcdef";
+        char code[6] = { '\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xf] };
+        put(code, 6);
+      }
+      break;
+    }
+    ptr = special + 1;
+  }
+  put('"');
+}
+
+// Writes the digits backward from end, two at a time.
+static char *format_digits(char *end, uint64_t value) {
+  static const char pairs[] = 
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  while (value >= 100) {
+    const char *pair = pairs + (value % 100) * 2;
+    value /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (value >= 10) {
+    const char *pair = pairs + value * 2;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  else
+    *--end = (char)('0' + value);
+  return end;
+}
+
+void jsonhead::json_writer::integer(int64_t value) {
+  char digits[24];
+  char *end = digits + sizeof(digits);
+  char *begin = format_digits(end, value < 0 ? 0 - (uint64_t)value : (uint64_t)value);
+  if (value < 0)
+    *--begin = '-';
+  put(begin, end - begin);
+}
+
+void jsonhead::json_writer::unsigned_integer(uint64_t value) {
+  char digits[24];
+  char *end = digits + sizeof(digits);
+  char *begin = format_digits(end, value);
+  put(begin, end - begin);
+}
+
+void jsonhead::json_writer::floating(double value) {
+  if (!std::isfinite(value)) {
+    put("null", 4);
+    return;
+  }
+
+  // Whole numbers below 1e15 are what %.15g prints them as, without the
+  // round trip through strtod.
+  if (std::fabs(value) < 1e15 && value == std::floor(value)) {
+    if (value == 0 && std::signbit(value))
+      put('-');
+    integer((int64_t)value);
+    put(".0", 2);
+    return;
+  }
+
+  char buffer[32];
+  // Shortest of the two precisions that reads back the same value.
+  snprintf(buffer, sizeof(buffer), "%.15g", value);
+  if (strtod(buffer, nullptr) != value)
+    snprintf(buffer, sizeof(buffer), "%.17g", value);
+  // Keep it a floating number when it is read back.
+  if (!strpbrk(buffer, ".eE"))
+    strcat(buffer, ".0");
+  put(buffer, strlen(buffer));
+}
+
+void jsonhead::json_writer::number(const json_number& number) {
+  switch (number.type)
+  {
+  case json_number_type::integer:
+    integer(number.i);
+    break;
+  case json_number_type::unsigned_integer:
+    unsigned_integer(number.u);
+    break;
+  case json_number_type::floating:
+    floating(number.d);
+    break;
+  }
+}
+
+void jsonhead::json_writer::flush() {
+  write_out(buffer.get(), size);
+  size = 0;
+}
+
+void jsonhead::json_writer::write_out(const char *ptr, size_t len) {
+  if (os != nullptr) {
+    os->write(ptr, len);
+    return;
+  }
+  while (len > 0) {
+    auto result = _write(fd, ptr, (unsigned)std::min<size_t>(len, 1 << 30));
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0) {
+      _error = true;
+      return;
+    }
+    ptr += result;
+    len -= result;
+  }
+}
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Model
+///
+///===-----------------------------------------------------------------------===
+
+std::ostream& jsonhead::json_value::print(std::ostream& os, bool format, std::string indent) const {
+  // Small enough to stay off the mmap threshold of malloc for every print.
+  json_writer writer(os, 64 * 1024);
+  writer.indent("  ", indent);
+  write(writer, format);
+  return os;
+}
+
+// Empty objects keep the blank line they have always been printed with.
+template <typename WriteMember>
+static void write_members(jsonhead::json_writer& writer, size_t count, bool format, 
+                          size_t depth, WriteMember write_member) {
+  writer.put('{');
+  if (format && count == 0)
+    writer.put('\n');
+  for (size_t i = 0; i < count; i++) {
+    if (format)
+      writer.newline(depth + 1);
+    write_member(i);
+    if (i + 1 != count)
+      writer.put(',');
+  }
+  if (format)
+    writer.newline(depth);
+  writer.put('}');
+}
+
+static void write_key(jsonhead::json_writer& writer, const jsonhead::String& key, bool format) {
+  writer.string(key);
+  if (format)
+    writer.put(": ", 2);
+  else
+    writer.put(':');
+}
+
+// write_element(i) writes the i-th element in document order.
+template <typename WriteElement>
+static void write_elements(jsonhead::json_writer& writer, size_t count, bool format, 
+                           size_t depth, WriteElement write_element) {
+  if (count == 0) {
+    writer.put("[]", 2);
+    return;
+  }
+  writer.put('[');
+  for (size_t i = 0; i < count; i++) {
+    if (format)
+      writer.newline(depth + 1);
+    write_element(i);
+    if (i + 1 != count)
+      writer.put(',');
+  }
+  if (format)
+    writer.newline(depth);
+  writer.put(']');
+}
+
+#ifdef CONFIG_SHAPES
+jsonhead::jvalue jsonhead::json_object::find(const char *key) const {
+  size_t i = shape->find(key, strlen(key));
+  return i == json_shape::npos ? jvalue() : values[i];
+}
+
+void jsonhead::json_object::write(json_writer& writer, bool format, size_t depth) const {
+  write_members(writer, size(), format, depth, [&](size_t i) {
+    write_key(writer, key(i), format);
+    values[i]->write(writer, format, depth + 1);
+  });
+}
+#else
+void jsonhead::json_object::write(json_writer& writer, bool format, size_t depth) const {
+  // Members are kept in reverse order.
+  auto it = keyvalue.rbegin();
+  write_members(writer, keyvalue.size(), format, depth, [&](size_t i) {
+    write_key(writer, it->first, format);
+    it->second->write(writer, format, depth + 1);
+    ++it;
+  });
+}
+#endif
+
+void jsonhead::json_array::write(json_writer& writer, bool format, size_t depth) const {
+#ifdef CONFIG_COLUMNS
+  if (columns != nullptr) {
+    write_elements(writer, columns->rows, format, depth, [&](size_t i) {
+      columns->write(writer, i, format, depth + 1);
+    });
+    return;
+  }
+#endif
+  // Elements are kept in reverse order.
+  write_elements(writer, array.size(), format, depth, [&](size_t i) {
+    array[array.size() - 1 - i]->write(writer, format, depth + 1);
+  });
+}
+
+#ifdef CONFIG_COLUMNS
+void jsonhead::json_column::write(json_writer& writer, size_t i, bool format, size_t depth) const {
+  switch (type)
+  {
+  case json_column_type::integer:
+    writer.integer(integers[i]);
+    break;
+
+  case json_column_type::floating:
+    writer.floating(doubles[i]);
+    break;
+
+  case json_column_type::boolean:
+    if (boolean(i))
+      writer.put("true", 4);
+    else
+      writer.put("false", 5);
+    break;
+
+  case json_column_type::string:
+    writer.string(strings[i]);
+    break;
+
+  case json_column_type::value:
+    values[i]->write(writer, format, depth);
+    break;
+  }
+}
+
+const jsonhead::json_column *jsonhead::json_columns::find(const char *key) const {
+  if (shape == nullptr)
+    return nullptr;
+  size_t i = shape->find(key, strlen(key));
+  return i == json_shape::npos ? nullptr : &fields[i];
+}
+
+void jsonhead::json_columns::write(json_writer& writer, size_t row, bool format, size_t depth) const {
+  if (shape == nullptr) {
+    fields[0].write(writer, row, format, depth);
+    return;
+  }
+  write_members(writer, shape->size, format, depth, [&](size_t i) {
+    write_key(writer, shape->keys[i], format);
+    fields[i].write(writer, row, format, depth + 1);
+  });
+}
+#endif
+
+jsonhead::json_numeric::json_numeric(String num)
+  : json_value(2), numstr(std::move(num)) {
+  json_parse_number(numstr.Reference(), numstr.Length(), number);
+  is_integer = number.type != json_number_type::floating;
+}
+
+void jsonhead::json_numeric::write(json_writer& writer, bool, size_t) const {
+  if (!numstr.Null())
+    writer.put(numstr.Reference(), numstr.Length());
+  else
+    writer.number(number);
+}
+
+jsonhead::String jsonhead::json_string::value() const {
+  if (!lazy)
+    return str;
+  if (escaped)
+    return json_unescape(str.Reference(), str.Length());
+  return String(str.Reference(), str.Length());
+}
+
+void jsonhead::json_string::write(json_writer& writer, bool, size_t) const {
+  if (lazy && escaped) {
+    // Decoded and escaped again, like the strings which are not lazy.
+    std::vector<char> decoded(str.Length() + 1);
+    writer.string(decoded.data(), json_unescape(decoded.data(), str.Reference(), str.Length()));
+  }
+  else
+    writer.string(str);
+}
+
+void jsonhead::json_state::write(json_writer& writer, bool, size_t) const {
+  switch (type) 
+  {
+  case json_token::v_false:
+    writer.put("false", 5);
+    break;
+
+  case json_token::v_true:
+    writer.put("true", 4);
+    break;
+
+  case json_token::v_null:
+    writer.put("null", 4);
+    break;
+
+  default:
+    break;
+  }
+}
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Tape
+///
+///===-----------------------------------------------------------------------===
+
+static const uint64_t tape_payload_mask = (1ULL << 56) - 1;
+
+void jsonhead::json_tape::clear() {
+  tape.clear();
+  strings.clear();
+  open_containers.clear();
+  commas.clear();
+}
+
+void jsonhead::json_tape::open(json_tape_type type) {
+  open_containers.push_back(tape.size());
+  commas.push_back(0);
+  append(type, 0);
+}
+
+void jsonhead::json_tape::close() {
+  size_t start = open_containers.back();
+  uint64_t count = start + 1 == tape.size() ? 0 : commas.back() + 1;
+  auto type = (json_tape_type)(tape[start] >> 56);
+  tape[start] |= tape.size();
+  append(type == json_tape_type::object ? json_tape_type::object_ends 
+                                        : json_tape_type::array_ends, count);
+  open_containers.pop_back();
+  commas.pop_back();
+}
+
+void jsonhead::json_tape::append_string(const char *ptr, size_t len, bool escaped) {
+  append(json_tape_type::string, strings.size());
+  size_t offset = strings.size();
+  strings.resize(offset + sizeof(uint32_t) + len + 1);
+  char *dest = &strings[offset + sizeof(uint32_t)];
+  if (escaped) {
+    // Decoded text is never longer than the escaped one.
+    len = json_unescape(dest, ptr, len);
+    strings.resize(offset + sizeof(uint32_t) + len + 1);
+    dest = &strings[offset + sizeof(uint32_t)];
+  }
+  else if (len > 0)
+    memcpy(dest, ptr, len);
+  dest[len] = 0;
+  // The length is kept in 32 bits in front of the text.
+  if (len > UINT32_MAX)
+    throw std::runtime_error("json string is too long for the tape!");
+  uint32_t length = (uint32_t)len;
+  memcpy(&strings[offset], &length, sizeof(uint32_t));
+}
+
+void jsonhead::json_tape::append_number(const json_number& number) {
+  uint64_t raw;
+  switch (number.type)
+  {
+  case json_number_type::integer:
+    append(json_tape_type::integer, 0);
+    memcpy(&raw, &number.i, sizeof(raw));
+    break;
+  case json_number_type::unsigned_integer:
+    append(json_tape_type::unsigned_integer, 0);
+    raw = number.u;
+    break;
+  default:
+    append(json_tape_type::floating, 0);
+    memcpy(&raw, &number.d, sizeof(raw));
+    break;
+  }
+  tape.push_back(raw);
+}
+
+void jsonhead::json_tape::append_keyword(json_tape_type type) {
+  append(type, 0);
+}
+
+size_t jsonhead::json_tape_ref::size() const {
+  return tape->tape[end().index] & tape_payload_mask;
+}
+
+jsonhead::json_tape_ref jsonhead::json_tape_ref::end() const {
+  return json_tape_ref(tape, tape->tape[index] & tape_payload_mask);
+}
+
+jsonhead::json_tape_ref jsonhead::json_tape_ref::next() const {
+  switch (type())
+  {
+  case json_tape_type::object:
+  case json_tape_type::array:
+    return json_tape_ref(tape, (tape->tape[index] & tape_payload_mask) + 1);
+  case json_tape_type::integer:
+  case json_tape_type::unsigned_integer:
+  case json_tape_type::floating:
+    return json_tape_ref(tape, index + 2);
+  default:
+    return json_tape_ref(tape, index + 1);
+  }
+}
+
+jsonhead::json_tape_ref jsonhead::json_tape_ref::at(size_t i) const {
+  if (!is_array())
+    throw std::runtime_error("value is not an array!");
+  auto it = begin(), last = end();
+  for (; it != last && i > 0; ++it, i--)
+    ;
+  if (it == last)
+    throw std::runtime_error("index out of range!");
+  return it;
+}
+
+jsonhead::json_tape_ref jsonhead::json_tape_ref::operator[](const char *key) const {
+  if (!is_object())
+    throw std::runtime_error("value is not an object!");
+  size_t len = strlen(key);
+  for (auto it = begin(), last = end(); it != last; ++it) {
+    auto value = it.next();
+    if (it.length() == len && !memcmp(it.c_str(), key, len))
+      return value;
+    it = value;
+  }
+  throw std::runtime_error("key not found!");
+}
+
+jsonhead::json_number jsonhead::json_tape_ref::number() const {
+  json_number number;
+  uint64_t raw = tape->tape[index + 1];
+  switch (type())
+  {
+  case json_tape_type::integer:
+    number.type = json_number_type::integer;
+    memcpy(&number.i, &raw, sizeof(raw));
+    break;
+  case json_tape_type::unsigned_integer:
+    number.type = json_number_type::unsigned_integer;
+    number.u = raw;
+    break;
+  case json_tape_type::floating:
+    number.type = json_number_type::floating;
+    memcpy(&number.d, &raw, sizeof(raw));
+    break;
+  default:
+    throw std::runtime_error("value is not a number!");
+  }
+  return number;
+}
+
+const char *jsonhead::json_tape_ref::c_str() const {
+  return &tape->strings[(tape->tape[index] & tape_payload_mask) + sizeof(uint32_t)];
+}
+
+size_t jsonhead::json_tape_ref::length() const {
+  uint32_t length;
+  memcpy(&length, &tape->strings[tape->tape[index] & tape_payload_mask], sizeof(uint32_t));
+  return length;
+}
+
+std::ostream& jsonhead::json_tape_ref::print(std::ostream& os, bool format, std::string indent) const {
+  json_writer writer(os, 64 * 1024);
+  writer.indent("  ", indent);
+  write(writer, format);
+  return os;
+}
+
+void jsonhead::json_tape_ref::write(json_writer& writer, bool format, size_t depth) const {
+  switch (type())
+  {
+  case json_tape_type::object:
+    writer.put('{');
+    if (format && begin() == end())
+      writer.put('\n');
+    for (auto it = begin(), last = end(); it != last; ) {
+      auto value = it.next();
+      if (format)
+        writer.newline(depth + 1);
+      writer.string(it.c_str(), it.length());
+      if (format)
+        writer.put(": ", 2);
+      else
+        writer.put(':');
+      value.write(writer, format, depth + 1);
+      it = value.next();
+      if (it != last)
+        writer.put(',');
+    }
+    if (format)
+      writer.newline(depth);
+    writer.put('}');
+    break;
+
+  case json_tape_type::array:
+    if (begin() == end()) {
+      writer.put("[]", 2);
+      break;
+    }
+    writer.put('[');
+    for (auto it = begin(), last = end(); it != last; ) {
+      if (format)
+        writer.newline(depth + 1);
+      it.write(writer, format, depth + 1);
+      ++it;
+      if (it != last)
+        writer.put(',');
+    }
+    if (format)
+      writer.newline(depth);
+    writer.put(']');
+    break;
+
+  case json_tape_type::string:
+    writer.string(c_str(), length());
+    break;
+
+  case json_tape_type::integer:
+  case json_tape_type::unsigned_integer:
+  case json_tape_type::floating:
+    writer.number(number());
+    break;
+
+  case json_tape_type::v_true:
+    writer.put("true", 4);
+    break;
+
+  case json_tape_type::v_false:
+    writer.put("false", 5);
+    break;
+
+  case json_tape_type::v_null:
+    writer.put("null", 4);
+    break;
+
+  default:
+    throw std::runtime_error("internal error!");
+  }
+}
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Document
+///
+///===-----------------------------------------------------------------------===
+
+jsonhead::json_document::json_document(std::string file_path, int threads)
+  : json_document(std::unique_ptr<json_source>(new json_mmap_source(file_path)), threads) {
+}
+
+jsonhead::json_document::json_document(std::unique_ptr<json_source> src, int threads)
+  : source(std::move(src)) {
+  // Positions are 32-bit offsets, refuse larger input before reading it.
+  if (source->size() > (long long)UINT32_MAX)
+    throw std::runtime_error("json document is larger than 4GB!");
+
+  if (source->data() != nullptr) {
+    text = source->data();
+    text_size = (size_t)source->size();
+  }
+  else {
+    const long long block = 1024 * 1024 * 4;
+    long long count;
+    do {
+      size_t offset = copy.size();
+      copy.resize(offset + block);
+      count = source->read(&copy[offset], block);
+      copy.resize(offset + count);
+      if (copy.size() > UINT32_MAX)
+        throw std::runtime_error("json document is larger than 4GB!");
+    } while (count == block);
+    text = copy.data();
+    text_size = copy.size();
+  }
+
+  json_structural_index index;
+  size_t window = std::max<size_t>(text_size / std::max(threads, 1) + 1, 1024 * 1024);
+  if (threads <= 1 || window >= text_size) {
+    index.index(text, text_size);
+    positions.swap(index.positions);
+    return;
+  }
+
+  std::vector<json_structural_index> windows;
+  index.index_parallel(text, text, text_size, window, windows);
+  size_t count = 0;
+  for (auto& w : windows)
+    count += w.size();
+  positions.reserve(count);
+  for (size_t i = 0; i < windows.size(); i++)
+    for (auto offset : windows[i].get())
+      positions.push_back((uint32_t)(i * window + offset));
+}
+
+size_t jsonhead::json_document::skip(size_t index) const {
+  char ch = at(index);
+  if (ch != '{' && ch != '[')
+    return index + 1;
+
+  size_t depth = 0;
+  for (; index < positions.size(); index++) {
+    ch = text[positions[index]];
+    if (ch == '{' || ch == '[')
+      depth++;
+    else if ((ch == '}' || ch == ']') && --depth == 0)
+      return index + 1;
+  }
+  throw std::runtime_error("unexpected end of json!");
+}
+
+static const char *number_end(const char *ptr, const char *end) {
+  while (ptr < end && (isdigit((unsigned char)*ptr) || *ptr == '-' || *ptr == '+' || 
+                       *ptr == '.' || *ptr == 'e' || *ptr == 'E'))
+    ptr++;
+  return ptr;
+}
+
+const char *jsonhead::json_cursor::text() const {
+  if (index >= doc->positions.size())
+    throw std::runtime_error("unexpected end of json!");
+  return doc->text + doc->positions[index];
+}
+
+jsonhead::json_token jsonhead::json_cursor::type() const {
+  if (index >= doc->positions.size())
+    return json_token::error;
+  const char *ptr = text();
+  size_t left = doc->text + doc->text_size - ptr;
+  switch (*ptr)
+  {
+  case '{':
+    return json_token::object_starts;
+  case '[':
+    return json_token::array_starts;
+  case '"':
+    return json_token::v_string;
+  case 't':
+    return left >= 4 && !memcmp(ptr, "true", 4) ? json_token::v_true : json_token::error;
+  case 'f':
+    return left >= 5 && !memcmp(ptr, "false", 5) ? json_token::v_false : json_token::error;
+  case 'n':
+    return left >= 4 && !memcmp(ptr, "null", 4) ? json_token::v_null : json_token::error;
+  default:
+    return *ptr == '-' || isdigit((unsigned char)*ptr) ? json_token::v_number : json_token::error;
+  }
+}
+
+jsonhead::json_cursor jsonhead::json_cursor::end() const {
+  return json_cursor(doc, doc->skip(index) - 1);
+}
+
+jsonhead::json_cursor jsonhead::json_cursor::next() const {
+  // Step over the ':' after a key or the ',' after a value.
+  size_t next = doc->skip(index);
+  char ch = doc->at(next);
+  if (ch == ':' || ch == ',')
+    next++;
+  return json_cursor(doc, next);
+}
+
+size_t jsonhead::json_cursor::size() const {
+  auto t = type();
+  if (t != json_token::object_starts && t != json_token::array_starts)
+    throw std::runtime_error("value is not a container!");
+  size_t count = 0;
+  for (auto it = begin(), last = end(); it != last; ++it)
+    count++;
+  return t == json_token::object_starts ? count / 2 : count;
+}
+
+jsonhead::json_cursor jsonhead::json_cursor::at(size_t i) const {
+  if (!is_array())
+    throw std::runtime_error("value is not an array!");
+  auto it = begin(), last = end();
+  for (; it != last && i > 0; ++it, i--)
+    ;
+  if (it == last)
+    throw std::runtime_error("index out of range!");
+  return it;
+}
+
+bool jsonhead::json_cursor::find(const char *key, json_cursor& value) const {
+  if (!is_object())
+    throw std::runtime_error("value is not an object!");
+  size_t len = strlen(key);
+  for (auto it = begin(), last = end(); it != last; ++it) {
+    auto member = it.next();
+    if (it.key_equals(key, len)) {
+      value = member;
+      return true;
+    }
+    it = member;
+  }
+  return false;
+}
+
+jsonhead::json_cursor jsonhead::json_cursor::operator[](const char *key) const {
+  json_cursor value = *this;
+  if (!find(key, value))
+    throw std::runtime_error("key not found!");
+  return value;
+}
+
+const char *jsonhead::json_cursor::string_body(size_t& len, bool& escaped) const {
+  if (type() != json_token::v_string)
+    throw std::runtime_error("value is not a string!");
+  const char *begin = text() + 1;
+  const char *end = doc->text + doc->text_size;
+  const char *ptr = begin;
+  escaped = false;
+  while (true) {
+    ptr = json_scan_string(ptr, end);
+    if (ptr == end)
+      throw std::runtime_error("unexpected end of json!");
+    if (*ptr == '"')
+      break;
+    if (*ptr == '\\') {
+      escaped = true;
+      ptr++;
+    }
+    ptr++;
+  }
+  len = ptr - begin;
+  return begin;
+}
+
+bool jsonhead::json_cursor::key_equals(const char *key, size_t len) const {
+  size_t length;
+  bool escaped;
+  const char *body = string_body(length, escaped);
+  if (!escaped)
+    return length == len && !memcmp(body, key, len);
+  // Decoded text is never longer than the escaped one.
+  if (length < len)
+    return false;
+  String decoded = json_unescape(body, length);
+  return decoded.Length() == len && !memcmp(decoded.Reference(), key, len);
+}
+
+jsonhead::json_number jsonhead::json_cursor::number() const {
+  json_number number;
+  if (type() != json_token::v_number)
+    throw std::runtime_error("value is not a number!");
+  const char *ptr = text();
+  const char *last = number_end(ptr, doc->text + doc->text_size);
+  if (!json_parse_number(ptr, last - ptr, number))
+    throw std::runtime_error("invalid number!");
+  return number;
+}
+
+bool jsonhead::json_cursor::boolean() const {
+  switch (type())
+  {
+  case json_token::v_true:
+    return true;
+  case json_token::v_false:
+    return false;
+  default:
+    throw std::runtime_error("value is not a boolean!");
+  }
+}
+
+jsonhead::String jsonhead::json_cursor::str() const {
+  size_t len;
+  bool escaped;
+  const char *body = string_body(len, escaped);
+  if (escaped)
+    return json_unescape(body, len);
+  return String(body, len);
+}
+
+std::ostream& jsonhead::json_cursor::print(std::ostream& os) const {
+  switch (type())
+  {
+  case json_token::object_starts:
+  case json_token::array_starts:
+    {
+      // Everything up to the matching bracket, strings included.
+      const char *begin = text();
+      os.write(begin, doc->text + doc->positions[end().index] + 1 - begin);
+    }
+    break;
+
+  case json_token::v_string:
+    {
+      size_t len;
+      bool escaped;
+      const char *body = string_body(len, escaped);
+      os.write(body - 1, len + 2);
+    }
+    break;
+
+  case json_token::v_number:
+    {
+      const char *ptr = text();
+      os.write(ptr, number_end(ptr, doc->text + doc->text_size) - ptr);
+    }
+    break;
+
+  case json_token::v_true:
+    os << "true";
+    break;
+
+  case json_token::v_false:
+    os << "false";
+    break;
+
+  case json_token::v_null:
+    os << "null";
+    break;
+
+  default:
+    throw std::runtime_error("invalid json!");
+  }
+  return os;
+}
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Parser
+///
+///===-----------------------------------------------------------------------===
+
+const int jsonhead::json_goto_table[28][20] = 
+{
+  {   0,   1,   3,   2,   0,   0,   0,   0,   4,   0,   0,   0,   5,   0,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  28 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  -1 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  -2 },
+  {   0,   0,   0,   0,   7,   8,   0,   0,   0,   6,   0,   0,   0,   0,   0,   0,   0,   9,   0,   0 },
+  {   0,   0,  16,  15,   0,   0,  11,  12,   4,   0,   0,   0,   5,  10,  17,  18,  19,  13,  14,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -5,  -5,   0,   0,  -5,   0,   0,   0,   0,   0,  -5 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  20,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -7,  21,   0,   0,   0,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  22,   0,   0,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -3,  -3,   0,   0,  -3,   0,   0,   0,   0,   0,  -3 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  23,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,  24,   0,   0, -10,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -12, -12,   0,   0, -12,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -13, -13,   0,   0, -13,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -14, -14,   0,   0, -14,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -15, -15,   0,   0, -15,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -16, -16,   0,   0, -16,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -17, -17,   0,   0, -17,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0, -18, -18,   0,   0, -18,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -6,  -6,   0,   0,  -6,   0,   0,   0,   0,   0,  -6 },
+  {   0,   0,   0,   0,  25,   8,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   9,   0,   0 },
+  {   0,   0,  16,  15,   0,   0,   0,  26,   4,   0,   0,   0,   5,   0,  17,  18,  19,  13,  14,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -4,  -4,   0,   0,  -4,   0,   0,   0,   0,   0,  -4 },
+  {   0,   0,  16,  15,   0,   0,  27,  12,   4,   0,   0,   0,   5,   0,  17,  18,  19,  13,  14,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -8,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,  -9,  -9,   0,   0,   0,   0,   0,   0,   0,   0,   0 },
+  {   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, -11,   0,   0,   0,   0,   0,   0 },
+};
+
+const int jsonhead::json_production[19] = {
+   1,   1,   1,   2,   3,   2,   3,   1,   3,   3,   1,   3,   1,   1,   1,   1,   1,   1,   1
+};
+
+const int jsonhead::json_group_table[19] = {
+   0,   1,   1,   2,   2,   3,   3,   4,   4,   5,   6,   6,   7,   7,   7,   7,   7,   7,   7
+};
+
+jsonhead::json_parser::json_parser(std::unique_ptr<json_source> source, size_t pool_capacity,
+                                   bool read_ahead, long long buffer_size)
+  : lex(std::move(source), buffer_size, read_ahead)
+#ifdef CONFIG_ALLOCATOR
+  , jarray_pool(pool_capacity), jobject_pool(pool_capacity), jstring_pool(pool_capacity),
+    jnumeric_pool(pool_capacity), jstate_pool(pool_capacity)
+#endif
+{
+}
+
+jsonhead::json_parser::json_parser(std::string file_path, size_t pool_capacity,
+                                   json_input_mode mode)
+  : lex(file_path, 1024 * 1024 * 32, mode)
+#ifdef CONFIG_ALLOCATOR
+  , jarray_pool(pool_capacity), jobject_pool(pool_capacity), jstring_pool(pool_capacity),
+    jnumeric_pool(pool_capacity), jstate_pool(pool_capacity)
+#endif
+{
+}
+
+jsonhead::json_parser::json_parser(size_t pool_capacity)
+#ifdef CONFIG_ALLOCATOR
+  : jarray_pool(pool_capacity), jobject_pool(pool_capacity), jstring_pool(pool_capacity),
+    jnumeric_pool(pool_capacity), jstate_pool(pool_capacity)
+#endif
+{
+}
+
+bool jsonhead::json_parser::feed(const char *ptr, size_t len) {
+  if (_error)
+    return false;
+  lex.feed(ptr, len);
+  while (step())
+    ;
+  return !_error;
+}
+
+bool jsonhead::json_parser::finish() {
+  if (_error)
+    return false;
+  lex.finish();
+  while (step())
+    ;
+  return !_error;
+}
+
+bool jsonhead::json_parser::step() {
+  if (!_reduce) {
+    bool skip = _skip_value || _skip_scalar;
+    bool containers = _skip_value;
+    _skip_value = _skip_scalar = false;
+    if (!(skip ? lex.skip_value(containers) : lex.next())) {
+      _error = true;
+      return false;
+    }
+    // The token held back after a record has to start a new line.
+    if (_record_end && lex.type() != json_token::eof && 
+        lex.type() != json_token::none && !lex.line_break()) {
+      _error = true;
+      return false;
+    }
+  }
+
+  // Pushed input ran out, the token is finished by the next chunk.
+  if (lex.type() == json_token::none && !_record_end) {
+    _reduce = false;
+    return false;
+  }
+   
+  _reduce = false;
+
+  if (stack.empty()) {
+    if (_json_lines && lex.type() == json_token::eof)
+      return false;
+    lex.track_line_breaks() = _json_lines;
+    if (_records > 0) {
+      // The previous record is released when the next one starts.
+      _entry = jvalue();
+      if (_build_tape)
+        _tape.clear();
+#ifdef CONFIG_ALLOCATOR
+      rewind_pools(pool_mark());
+#endif
+    }
+    stack.push(0);
+  }
+
+  // The token after a closed record is held back, and the record is
+  // finished as if the input ended there.
+  auto type = _record_end ? json_token::eof : lex.type();
+
+  int code = json_goto_table[stack.top()][(int)type];
+
+  if (code == json_accept_index)
+  {
+    // End of json format
+    if (!_build_tape) {
+      _entry = values.top();
+      values.pop();
+    }
+    if (!_json_lines)
+      return false;
+
+    _records++;
+    while (!stack.empty())
+      stack.pop();
+    _record_end = false;
+    if (_record_callback && !_build_tape) {
+      _record_callback(std::move(_entry));
+      _entry = jvalue();
+    }
+    if (_tape_record_callback && _build_tape) {
+      _tape_record_callback(_tape.root());
+      _tape.clear();
+    }
+    // Start the next record with the held back token.
+    _reduce = true;
+  }
+  else if (code > 0)
+  {
+    // Shift
+    stack.push(code);
+    if (_build_tape)
+      tape_shift(type, code);
+    else {
+      push_content();
+#ifdef CONFIG_COLUMNS
+      if (_columnar && type == json_token::array_starts)
+        array_marks.push_back(mark_pools());
+#endif
+      if (_element_callback)
+        track_path(type, code);
+      if (!_selection.empty())
+        track_selection(type, code);
+    }
+    if (_json_lines) {
+      if (type == json_token::object_starts || type == json_token::array_starts)
+        _depth++;
+      else if ((type == json_token::object_ends || type == json_token::array_ends) && --_depth == 0)
+        _record_end = true;
+    }
+  }
+  else if (code < 0)
+  {
+    // Reduce
+    reduce(code);
+    _reduce = true;
+  }
+  else
+  {
+    // Panic mode
+    this->_error = true;
+    return false;
+  }
+
+  return true;
+}
+
+void jsonhead::json_parser::reduce(int code) {
+  int reduce_production = -code;
+
+  // Reduce Stack
+  for (int i = 0; i < json_production[reduce_production]; i++) {
+    stack.pop();
+  }
+
+  stack.push(json_goto_table[stack.top()][json_group_table[reduce_production]]);
+
+  // The tape is written at shift time, only the states are reduced.
+  if (_build_tape)
+    return;
+
+  //   0:         S' -> JSON
+  //   1:       JSON -> OBJECT
+  //   2:       JSON -> ARRAY
+  //   3:      ARRAY -> [ ]
+  //   4:      ARRAY -> [ ELEMENTS ]
+  //   5:     OBJECT -> { }
+  //   6:     OBJECT -> { MEMBERS }
+  //   7:    MEMBERS -> PAIR
+  //   8:    MEMBERS -> PAIR , MEMBERS
+  //   9:       PAIR -> v_string : VALUE
+  //  10:   ELEMENTS -> VALUE
+  //  11:   ELEMENTS -> VALUE , ELEMENTS
+  //  12:      VALUE -> v_string
+  //  13:      VALUE -> v_number
+  //  14:      VALUE -> OBJECT
+  //  15:      VALUE -> ARRAY
+  //  16:      VALUE -> true
+  //  17:      VALUE -> false
+  //  18:      VALUE -> null
+
+  switch (reduce_production)
+  {
+  //case 0:
+  //case 1:
+  //case 2:
+
+  case 3:
+    pop_content();
+    pop_content();
+#ifdef CONFIG_COLUMNS
+    if (_columnar)
+      array_marks.pop_back();
+#endif
+#ifndef CONFIG_ALLOCATOR
+    values.push(jarray(new json_array));
+#else
+    values.push(jarray(jarray_pool.allocate(data)));
+#endif
+    break;
+
+  case 4:
+    pop_content();
+    pop_content();
+#ifdef CONFIG_COLUMNS
+    if (_columnar) {
+      columnize(array_marks.back());
+      array_marks.pop_back();
+    }
+#endif
+    break;
+
+  case 5:
+    pop_content();
+    pop_content();
+#ifndef CONFIG_ALLOCATOR
+    values.push(jobject(new json_object()));
+#elif defined(CONFIG_SHAPES)
+    values.push(jobject(jobject_pool.allocate(json_shape::empty(), nullptr)));
+#else
+    values.push(jobject(jobject_pool.allocate(data)));
+#endif
+    break;
+
+  case 6:
+    pop_content();
+    pop_content();
+#ifdef CONFIG_SHAPES
+    values.push(build_object());
+#endif
+    break;
+
+#ifdef CONFIG_SHAPES
+  case 7:
+  case 8:
+    {
+      // MEMBERS has no value, the pairs are collected until the object
+      // closes and gets its shape.
+      if (reduce_production == 8)
+        pop_content();
+      member m;
+      m.value = values.top();
+      values.pop();
+      // Values outside the selection leave an empty placeholder.
+      if (m.value) {
+        if (_skip_literal && m.value->is_string())
+          m.value = jstring_pool.allocate(std::move(String()));
+        m.key = materialize_key(contents.top(), &m.id);
+        members.push_back(std::move(m));
+      }
+      pop_content();
+    }
+    break;
+#else
+  case 7:
+    {
+#ifndef CONFIG_ALLOCATOR
+      auto jo = jobject(new json_object());
+#else
+      auto jo = jobject(jobject_pool.allocate(data));
+#endif
+      // Values outside the selection leave an empty placeholder.
+      if (!values.top())
+        ;
+      else if (!(_skip_literal && values.top()->is_string()))
+#ifndef CONFIG_STABLE
+        jo->keyvalue[materialize_key(contents.top())] = std::move(values.top());
+#else
+        jo->keyvalue.push_back({materialize_key(contents.top()), std::move(values.top())});
+#endif
+#ifndef CONFIG_ALLOCATOR
+      else
+        
+#ifndef CONFIG_STABLE
+        jo->keyvalue[materialize_key(contents.top())] = std::shared_ptr<json_string>(new json_string(std::move(String())));
+#else
+        jo->keyvalue.push_back({materialize_key(contents.top()), std::shared_ptr<json_string>(new json_string(std::move(String())))});
+#endif
+#else
+      else
+#ifndef CONFIG_STABLE
+        jo->keyvalue[materialize_key(contents.top())] = jstring_pool.allocate(std::move(String()));
+#else
+        jo->keyvalue.push_back({materialize_key(contents.top()), jstring_pool.allocate(std::move(String()))});
+#endif
+#endif
+      values.pop();
+      values.push(jo);
+      pop_content();
+    }
+    break;
+
+  case 8:
+    {
+      pop_content();
+      auto jo = values.top(); values.pop();
+      if (!values.top())
+        ;
+      else if (!(_skip_literal && values.top()->is_string()))
+#ifndef CONFIG_STABLE
+        ((json_object*)&*jo)->keyvalue[materialize_key(contents.top())] = std::move(values.top());
+#else
+        ((json_object*)&*jo)->keyvalue.push_back({materialize_key(contents.top()), std::move(values.top())});
+#endif
+#ifndef CONFIG_ALLOCATOR
+      else
+#ifndef CONFIG_STABLE
+        ((json_object*)&*jo)->keyvalue[materialize_key(contents.top())] = std::shared_ptr<json_string>(new json_string(std::move(String())));
+#else
+        ((json_object*)&*jo)->keyvalue.push_back({materialize_key(contents.top()), std::shared_ptr<json_string>(new json_string(std::move(String())))});
+#endif
+#else
+      else
+#ifndef CONFIG_STABLE
+        ((json_object*)&*jo)->keyvalue[materialize_key(contents.top())] = jstring_pool.allocate(std::move(String()));
+#else
+        ((json_object*)&*jo)->keyvalue.push_back({materialize_key(contents.top()), jstring_pool.allocate(std::move(String()))});
+#endif
+#endif
+      values.pop();
+      values.push(jo);
+      pop_content();
+    }
+    break;
+
+#endif
+
+  case 9:
+    pop_content();
+    break;
+
+  case 10:
+    {
+#ifndef CONFIG_ALLOCATOR
+      auto ja = jarray(new json_array());
+#else
+      auto ja = jarray(jarray_pool.allocate(data));
+#endif
+      // Streamed and skipped elements leave an empty placeholder.
+      if (values.top() && !(_skip_literal && values.top()->is_string()))
+        ja->array.push_back(values.top());
+      values.pop();
+      values.push(ja);
+    }
+    break;
+
+  case 11:
+    {
+      auto ja = values.top(); values.pop();
+      if (values.top() && !(_skip_literal && values.top()->is_string()))
+        ((json_array*)&*ja)->array.push_back(values.top());
+      values.pop();
+      values.push(ja);
+      pop_content();
+    }
+    break;
+
+  case 12:
+#ifdef CONFIG_ALLOCATOR
+    if (_lazy_strings && !_skip_literal && lex.resident()) {
+      auto& slice = contents.top();
+      values.push(jstring_pool.allocate(content(slice), slice.length, slice.escaped));
+      pop_content();
+      break;
+    }
+#endif
+    {
+      // Literals are dropped by the parent when skipping, do not copy them.
+      String str = _skip_literal ? String() : materialize(contents.top());
+#ifndef CONFIG_ALLOCATOR
+      values.push(std::shared_ptr<json_string>(new json_string(std::move(str))));
+#else
+      values.push(jstring_pool.allocate(std::move(str)));
+#endif
+    }
+    pop_content();
+    break;
+
+  case 13:
+    {
+      String text = _keep_number_text || !numbers.top().finite() ? 
+                    materialize(contents.top()) : String();
+#ifndef CONFIG_ALLOCATOR
+      values.push(std::shared_ptr<json_numeric>(new json_numeric(numbers.top(), std::move(text))));
+#else
+      values.push(jnumeric_pool.allocate(numbers.top(), std::move(text)));
+#endif
+    }
+    numbers.pop();
+    pop_content();
+    break;
+
+  //case 14:
+  //case 15:
+
+  case 16:
+#ifndef CONFIG_ALLOCATOR
+    values.push(std::shared_ptr<json_state>(new json_state(jsonhead::json_token::v_true)));
+#else
+    values.push(jstate_pool.allocate(jsonhead::json_token::v_true));
+#endif
+    pop_content();
+    break;
+
+  case 17:
+#ifndef CONFIG_ALLOCATOR
+    values.push(std::shared_ptr<json_state>(new json_state(jsonhead::json_token::v_false)));
+#else
+    values.push(jstate_pool.allocate(jsonhead::json_token::v_false));
+#endif
+    pop_content();
+    break;
+
+  case 18:
+    if (_skipped)
+      values.push(jvalue());
+    else
+#ifndef CONFIG_ALLOCATOR
+      values.push(std::shared_ptr<json_state>(new json_state(jsonhead::json_token::v_null)));
+#else
+      values.push(jstate_pool.allocate(jsonhead::json_token::v_null));
+#endif
+    _skipped = false;
+    pop_content();
+    break;
+  }
+
+  // A value has been reduced as an element of an array.
+  if (_element_callback && stack.top() == 12)
+    stream_element();
+}
+
+static std::vector<std::string> parse_json_pointer(const std::string& path) {
+  std::vector<std::string> segments;
+  if (path.empty())
+    return segments;
+  if (path[0] != '/')
+    throw std::runtime_error("json pointer must start with '/'!");
+
+  for (size_t i = 1; i <= path.length(); i++) {
+    if (i == 1 || path[i - 1] == '/')
+      segments.emplace_back();
+    if (i == path.length())
+      break;
+    if (path[i] == '/')
+      continue;
+    if (path[i] == '~' && i + 1 < path.length() && (path[i + 1] == '0' || path[i + 1] == '1'))
+      segments.back().push_back(path[++i] == '0' ? '~' : '/');
+    else
+      segments.back().push_back(path[i]);
+  }
+  return segments;
+}
+
+void jsonhead::json_parser::on_element(std::function<void(jvalue)> callback, const std::string& path) {
+  _element_callback = std::move(callback);
+  _element_path = parse_json_pointer(path);
+}
+
+void jsonhead::json_parser::track_path(json_token type, int state) {
+  switch (type)
+  {
+  case json_token::object_starts:
+  case json_token::array_starts:
+    {
+      bool matched = true;
+      if (!frames.empty()) {
+        auto& parent = frames.back();
+        size_t depth = frames.size();
+        if (!parent.matched || depth > _element_path.size())
+          matched = false;
+        else if (parent.array)
+          matched = _element_path[depth - 1] == std::to_string(parent.index);
+        else
+          matched = parent.key_matched;
+      }
+      path_frame frame;
+      frame.array = type == json_token::array_starts;
+      frame.matched = matched;
+      frames.push_back(frame);
+#ifdef CONFIG_ALLOCATOR
+      // Elements are allocated after this, and released one by one.
+      if (frame.array && matched && frames.size() == _element_path.size() + 1)
+        element_mark = mark_pools();
+#endif
+    }
+    break;
+
+  case json_token::object_ends:
+  case json_token::array_ends:
+    frames.pop_back();
+    break;
+
+  case json_token::v_comma:
+    frames.back().index++;
+    break;
+
+  case json_token::v_string:
+    // Shifting state 9 means the string is a key.
+    if (state == 9) {
+      auto& frame = frames.back();
+      frame.key_matched = false;
+      if (frame.matched && frames.size() <= _element_path.size()) {
+        auto& segment = _element_path[frames.size() - 1];
+        if (lex.token_escaped()) {
+          String key = lex.str();
+          frame.key_matched = key.Length() == segment.length() &&
+                              !memcmp(key.Reference(), segment.c_str(), key.Length());
+        }
+        else
+          frame.key_matched = (size_t)lex.token_length() == segment.length() &&
+                              !memcmp(lex.token(), segment.c_str(), segment.length());
+      }
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+void jsonhead::json_parser::stream_element() {
+  auto& frame = frames.back();
+  if (!frame.matched || frames.size() != _element_path.size() + 1)
+    return;
+
+  if (values.top()) {
+    _elements++;
+    _element_callback(std::move(values.top()));
+  }
+  values.pop();
+#ifdef CONFIG_ALLOCATOR
+  rewind_pools(element_mark);
+#endif
+
+  // ELEMENTS is right recursive, so the elements are folded into the first
+  // one to keep the stacks bounded: [ VALUE , VALUE becomes [ VALUE.
+  int state = stack.top(); stack.pop();
+  if (stack.top() == 24) {
+    stack.pop();
+    pop_content();
+  }
+  else {
+    stack.push(state);
+    values.push(jvalue());
+  }
+}
+
+// "$", ".name", ".*", "[0]", "[*]" and "['name']" segments of JSONPath.
+static std::vector<std::string> parse_json_path(const std::string& path) {
+  std::vector<std::string> segments;
+  size_t i = 1;
+  while (i < path.length()) {
+    if (path[i] == '.') {
+      size_t end = path.find_first_of(".[", ++i);
+      if (end == std::string::npos)
+        end = path.length();
+      if (end == i)
+        throw std::runtime_error("empty json path member!");
+      segments.push_back(path.substr(i, end - i));
+      i = end;
+    }
+    else if (path[i] == '[' && i + 1 < path.length()) {
+      char quote = path[i + 1];
+      size_t end;
+      if (quote == '\'' || quote == '"') {
+        end = path.find(quote, i + 2);
+        if (end == std::string::npos || end + 1 >= path.length() || path[end + 1] != ']')
+          throw std::runtime_error("unterminated json path member!");
+        segments.push_back(path.substr(i + 2, end - i - 2));
+        i = end + 2;
+      }
+      else {
+        end = path.find(']', i + 1);
+        if (end == std::string::npos || end == i + 1)
+          throw std::runtime_error("unterminated json path index!");
+        segments.push_back(path.substr(i + 1, end - i - 1));
+        if (segments.back() != "*" &&
+            segments.back().find_first_not_of("0123456789") != std::string::npos)
+          throw std::runtime_error("unsupported json path index!");
+        i = end + 1;
+      }
+    }
+    else
+      throw std::runtime_error("unsupported json path!");
+  }
+  return segments;
+}
+
+void jsonhead::json_parser::select(const std::vector<std::string>& paths) {
+  _selection.clear();
+  for (auto& path : paths) {
+    if (!path.empty() && path[0] == '$')
+      _selection.push_back(parse_json_path(path));
+    else
+      _selection.push_back(parse_json_pointer(path));
+  }
+}
+
+void jsonhead::json_parser::track_selection(json_token type, int state) {
+  switch (type)
+  {
+  case json_token::object_starts:
+  case json_token::array_starts:
+    {
+      select_frame frame;
+      frame.array = type == json_token::array_starts;
+      if (selected.empty()) {
+        frame.full = false;
+        for (int i = 0; i < (int)_selection.size(); i++) {
+          if (_selection[i].empty())
+            frame.full = true;
+          else
+            frame.paths.push_back(i);
+        }
+      }
+      else {
+        auto& parent = selected.back();
+        frame.full = parent.full || parent.child_full;
+        if (!frame.full)
+          frame.paths = parent.child;
+      }
+      selected.push_back(std::move(frame));
+      if (selected.back().array)
+        select_element(selected.back());
+    }
+    break;
+
+  case json_token::object_ends:
+  case json_token::array_ends:
+    selected.pop_back();
+    break;
+
+  case json_token::v_comma:
+    if (selected.back().array) {
+      selected.back().index++;
+      select_element(selected.back());
+    }
+    break;
+
+  case json_token::v_pair:
+    {
+      auto& frame = selected.back();
+      _skip_value = !frame.full && frame.child.empty();
+      _skip_scalar = !frame.full && !frame.child_full;
+    }
+    break;
+
+  case json_token::v_string:
+    // Shifting state 9 means the string is a key.
+    if (state == 9 && !selected.back().full) {
+      if (lex.token_escaped()) {
+        String key = lex.str();
+        select_child(selected.back(), key.Reference(), key.Length());
+      }
+      else
+        select_child(selected.back(), lex.token(), lex.token_length());
+    }
+    break;
+
+  case json_token::v_null:
+    _skipped = lex.skipped();
+    break;
+
+  default:
+    break;
+  }
+}
+
+void jsonhead::json_parser::select_child(select_frame& frame, const char *name, size_t len) {
+  size_t depth = selected.size();
+  frame.child.clear();
+  frame.child_full = false;
+  for (int i : frame.paths) {
+    auto& path = _selection[i];
+    auto& segment = path[depth - 1];
+    if (segment == "*" || (segment.length() == len && !memcmp(segment.c_str(), name, len))) {
+      frame.child.push_back(i);
+      if (path.size() == depth)
+        frame.child_full = true;
+    }
+  }
+}
+
+void jsonhead::json_parser::select_element(select_frame& frame) {
+  if (frame.full)
+    return;
+  char digits[24];
+  int len = snprintf(digits, sizeof digits, "%lld", frame.index);
+  select_child(frame, digits, len);
+  _skip_value = frame.child.empty();
+  _skip_scalar = !frame.child_full;
+}
+
+void jsonhead::json_parser::tape_shift(json_token type, int state) {
+  switch (type)
+  {
+  case json_token::object_starts:
+    _tape.open(json_tape_type::object);
+    break;
+
+  case json_token::array_starts:
+    _tape.open(json_tape_type::array);
+    break;
+
+  case json_token::object_ends:
+  case json_token::array_ends:
+    _tape.close();
+    break;
+
+  case json_token::v_comma:
+    _tape.next_element();
+    break;
+
+  case json_token::v_string:
+    // Shifting state 13 means the string is a value.
+    if (_skip_literal && state == 13)
+      _tape.append_string(nullptr, 0, false);
+    else
+      _tape.append_string(lex.token(), lex.token_length(), lex.token_escaped());
+    break;
+
+  case json_token::v_number:
+    _tape.append_number(lex.number());
+    break;
+
+  case json_token::v_true:
+    _tape.append_keyword(json_tape_type::v_true);
+    break;
+
+  case json_token::v_false:
+    _tape.append_keyword(json_tape_type::v_false);
+    break;
+
+  case json_token::v_null:
+    _tape.append_keyword(json_tape_type::v_null);
+    break;
+
+  default:
+    break;
+  }
+}
+
+void jsonhead::json_parser::push_content() {
+  json_slice slice;
+  auto type = lex.type();
+
+  if (type == json_token::v_number)
+    numbers.push(lex.number());
+
+  // Numbers which overflow a double keep their text to be written back.
+  if (type == json_token::v_string || (type == json_token::v_number && 
+      (_keep_number_text || !numbers.top().finite()))) {
+    slice.length = lex.token_length();
+    slice.escaped = lex.token_escaped();
+    if (lex.resident()) {
+      // Refer the input directly, it outlives every token.
+      slice.offset = lex.token() - lex.data();
+      contents.push(slice);
+      return;
+    }
+    slice.offset = scratch.size();
+    scratch.insert(scratch.end(), lex.token(), lex.token() + slice.length);
+  }
+  else
+    slice.offset = lex.resident() ? 0 : scratch.size();
+
+  contents.push(slice);
+}
+
+void jsonhead::json_parser::pop_content() {
+  if (!lex.resident())
+    scratch.resize(contents.top().offset);
+  contents.pop();
+}
+
+const char *jsonhead::json_parser::content(const json_slice& slice) const {
+  if (lex.resident())
+    return lex.data() + slice.offset;
+  return scratch.data() + slice.offset;
+}
+
+jsonhead::String jsonhead::json_parser::materialize(const json_slice& slice) {
+#ifdef CONFIG_ALLOCATOR
+  // Refer the copy in the arena, it is released with the nodes.
+  if (!slice.escaped)
+    return String(data.allocate_string(content(slice), slice.length), slice.length);
+  char *str = (char *)data.allocate(slice.length + 1, 1);
+  size_t length = json_unescape(str, content(slice), slice.length);
+  str[length] = 0;
+  return String(str, length);
+#else
+  if (slice.escaped)
+    return json_unescape(content(slice), slice.length);
+  return String(content(slice), slice.length);
+#endif
+}
+
+jsonhead::String jsonhead::json_parser::materialize_key(const json_slice& slice, uint32_t *id) {
+#ifdef CONFIG_ALLOCATOR
+  const char *ptr = content(slice);
+  size_t length = slice.length;
+  if (slice.escaped) {
+    key_scratch.resize(length + 1);
+    length = json_unescape(key_scratch.data(), ptr, length);
+    ptr = key_scratch.data();
+  }
+  uint32_t symbol = _symbols->intern(ptr, length);
+  if (id != nullptr)
+    *id = symbol;
+  if (symbol != json_symbol_table::npos) {
+    auto& name = _symbols->name(symbol);
+    return String((char *)name.Reference(), name.Length());
+  }
+#endif
+  return materialize(slice);
+}
+
+#ifdef CONFIG_SHAPES
+jsonhead::jvalue jsonhead::json_parser::build_object() {
+  size_t count = members.size();
+  bool interned = true;
+  member_ids.clear();
+  for (size_t i = count; i > 0; i--) {
+    member_ids.push_back(members[i - 1].id);
+    interned = interned && members[i - 1].id != json_symbol_table::npos;
+  }
+
+  const json_shape *shape = interned ? _symbols->shape(member_ids.data(), count) : nullptr;
+  if (shape == nullptr) {
+    // Keys which are not interned live with the nodes, so does the shape.
+    member_keys.clear();
+    for (size_t i = count; i > 0; i--)
+      member_keys.push_back(std::move(members[i - 1].key));
+    shape = json_shape::create(data, member_keys.data(), count);
+  }
+
+  jvalue *fields = (jvalue *)data.allocate(count * sizeof(jvalue), alignof(jvalue));
+  for (size_t i = 0; i < count; i++)
+    fields[i] = members[count - 1 - i].value;
+  members.clear();
+  return jobject(jobject_pool.allocate(shape, fields));
+}
+#endif
+
+#ifdef CONFIG_ALLOCATOR
+jsonhead::json_parser::pool_mark jsonhead::json_parser::mark_pools() const {
+  return {{ jarray_pool.mark(), jobject_pool.mark(), jstring_pool.mark(), 
+            jnumeric_pool.mark(), jstate_pool.mark(), data.mark() }};
+}
+
+void jsonhead::json_parser::rewind_pools(const pool_mark& mark) {
+  jarray_pool.rewind(mark[0]);
+  jobject_pool.rewind(mark[1]);
+  jstring_pool.rewind(mark[2]);
+  jnumeric_pool.rewind(mark[3]);
+  jstate_pool.rewind(mark[4]);
+  data.rewind(mark[5]);
+}
+#endif
+
+#ifdef CONFIG_COLUMNS
+static bool column_type_of(const jsonhead::json_value *value, jsonhead::json_column_type& type) {
+  using namespace jsonhead;
+  if (value->is_numeric()) {
+    auto& number = ((const json_numeric *)value)->number;
+    if (number.type == json_number_type::integer)
+      type = json_column_type::integer;
+    else if (number.type == json_number_type::floating && number.finite())
+      type = json_column_type::floating;
+    else
+      type = json_column_type::value;
+  }
+  else if (value->is_string())
+    // Lazy strings stay in the input, their nodes are kept.
+    type = ((const json_string *)value)->lazy ? json_column_type::value : json_column_type::string;
+  else if (value->is_keyword()) {
+    auto token = ((const json_state *)value)->type;
+    type = token == json_token::v_null ? json_column_type::value : json_column_type::boolean;
+  }
+  else
+    // Nested arrays and objects are not kept.
+    return false;
+  return true;
+}
+
+void jsonhead::json_parser::columnize(const pool_mark& mark) {
+  auto array = (json_array *)&*values.top();
+  size_t rows = array->array.size();
+  if (_keep_number_text || rows < 2)
+    return;
+
+  // Elements are kept in reverse order.
+  auto row = [&](size_t r) { return &*array->array[rows - 1 - r]; };
+  const json_shape *shape = nullptr;
+  size_t count = 1;
+  if (row(0)->is_object()) {
+    shape = ((json_object *)row(0))->shape;
+    count = shape->size;
+    if (count == 0)
+      return;
+    // Objects share a shape only if their keys are interned, so the keys
+    // stay valid while the pools are rewound.
+    for (size_t r = 1; r < rows; r++)
+      if (!row(r)->is_object() || ((json_object *)row(r))->shape != shape)
+        return;
+  }
+  auto cell = [&](size_t r, size_t f) {
+    return shape ? &*((json_object *)row(r))->values[f] : row(r);
+  };
+
+  column_types.resize(count);
+  for (size_t f = 0; f < count; f++) {
+    auto& type = column_types[f];
+    if (!column_type_of(cell(0, f), type))
+      return;
+    for (size_t r = 1; r < rows; r++) {
+      json_column_type next;
+      if (!column_type_of(cell(r, f), next))
+        return;
+      if (next != type)
+        type = json_column_type::value;
+    }
+    // A column of values saves nothing over the array itself.
+    if (!shape && type == json_column_type::value)
+      return;
+  }
+
+  // Copy the columns out of the nodes, as compact as they are stored.
+  column_words.clear();
+  column_cells.clear();
+  column_text.clear();
+  for (size_t f = 0; f < count; f++)
+    for (size_t r = 0; r < rows; r++) {
+      auto value = cell(r, f);
+      switch (column_types[f])
+      {
+      case json_column_type::integer:
+      case json_column_type::floating:
+        // The same bits for both.
+        column_words.push_back(((json_numeric *)value)->number.u);
+        break;
+
+      case json_column_type::boolean:
+        if (r % 64 == 0)
+          column_words.push_back(0);
+        if (((json_state *)value)->type == json_token::v_true)
+          column_words.back() |= (uint64_t)1 << (r % 64);
+        break;
+
+      case json_column_type::string:
+        {
+          auto& str = ((json_string *)value)->str;
+          column_words.push_back(column_text.length());
+          column_words.push_back(str.Length());
+          column_text.append(str.Reference(), str.Length());
+        }
+        break;
+
+      case json_column_type::value:
+        {
+          column_cell c;
+          c.kind = value->is_numeric() ? 2 : value->is_string() ? 3 : 4;
+          if (value->is_numeric())
+            c.number = ((json_numeric *)value)->number;
+          else if (value->is_string() && ((json_string *)value)->lazy) {
+            auto string = (json_string *)value;
+            c.kind = 5;
+            c.body = string->str.Reference();
+            c.length = string->str.Length();
+            c.escaped = string->escaped;
+          }
+          else if (value->is_string()) {
+            auto& str = ((json_string *)value)->str;
+            c.offset = column_text.length();
+            c.length = str.Length();
+            column_text.append(str.Reference(), str.Length());
+          }
+          else
+            c.keyword = ((json_state *)value)->type;
+          column_cells.push_back(c);
+        }
+        break;
+      }
+    }
+
+  // Everything allocated since the array started belongs to its elements.
+  rewind_pools(mark);
+
+  auto columns = (json_columns *)data.allocate(sizeof(json_columns), alignof(json_columns));
+  auto fields = (json_column *)data.allocate(count * sizeof(json_column), alignof(json_column));
+  columns->rows = rows;
+  columns->shape = shape;
+  columns->fields = fields;
+  const uint64_t *words = column_words.data();
+  const column_cell *cells = column_cells.data();
+  for (size_t f = 0; f < count; f++) {
+    auto& column = fields[f];
+    column.type = column_types[f];
+    switch (column.type)
+    {
+    case json_column_type::integer:
+    case json_column_type::floating:
+    case json_column_type::boolean:
+      {
+        size_t size = column.type == json_column_type::boolean ? (rows + 63) / 64 : rows;
+        auto bits = (uint64_t *)data.allocate(size * sizeof(uint64_t), alignof(uint64_t));
+        memcpy(bits, words, size * sizeof(uint64_t));
+        column.bits = bits;
+        words += size;
+      }
+      break;
+
+    case json_column_type::string:
+      {
+        auto strings = (String *)data.allocate(rows * sizeof(String), alignof(String));
+        for (size_t r = 0; r < rows; r++, words += 2)
+          new (&strings[r]) String(data.allocate_string(column_text.data() + words[0], words[1]), words[1]);
+        column.strings = strings;
+      }
+      break;
+
+    case json_column_type::value:
+      {
+        auto values = (jvalue *)data.allocate(rows * sizeof(jvalue), alignof(jvalue));
+        for (size_t r = 0; r < rows; r++, cells++) {
+          if (cells->kind == 2)
+            values[r] = jnumeric_pool.allocate(cells->number);
+          else if (cells->kind == 3)
+            values[r] = jstring_pool.allocate(String(
+              data.allocate_string(column_text.data() + cells->offset, cells->length), cells->length));
+          else if (cells->kind == 5)
+            values[r] = jstring_pool.allocate(cells->body, cells->length, cells->escaped);
+          else
+            values[r] = jstate_pool.allocate(cells->keyword);
+        }
+        column.values = values;
+      }
+      break;
+    }
+  }
+
+  auto ja = jarray_pool.allocate(data);
+  ja->columns = columns;
+  values.pop();
+  values.push(jarray(ja));
+}
+#endif
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Validator
+///
+///===-----------------------------------------------------------------------===
+
+jsonhead::json_validator::json_validator(std::string file_path, json_input_mode mode)
+  : lex(file_path, 1024 * 1024 * 32, mode), file_path(file_path) {
+  lex.decode_numbers() = false;
+  lex.strict() = true;
+}
+
+jsonhead::json_validator::json_validator(std::unique_ptr<json_source> source, bool read_ahead)
+  : lex(std::move(source), 1024 * 1024 * 32, read_ahead) {
+  lex.decode_numbers() = false;
+  lex.strict() = true;
+}
+
+bool jsonhead::json_validator::validate() {
+  stack.clear();
+  stack.push_back(0);
+
+  while (true) {
+    if (!lex.next())
+      return fail(lex.error_position());
+
+    auto type = lex.type();
+    while (true) {
+      int code = json_goto_table[stack.back()][(int)type];
+
+      if (code == json_accept_index)
+        return true;
+      else if (code > 0) {
+        stack.push_back(code);
+        counts[(int)type]++;
+        break;
+      }
+      else if (code < 0) {
+        stack.resize(stack.size() - json_production[-code]);
+        stack.push_back(json_goto_table[stack.back()][json_group_table[-code]]);
+      }
+      else
+        return fail(lex.token_position());
+    }
+  }
+}
+
+long long jsonhead::json_validator::tokens() const {
+  long long total = 0;
+  for (auto count : counts)
+    total += count;
+  return total;
+}
+
+bool jsonhead::json_validator::fail(long long offset) {
+  _error_offset = offset;
+
+  // Lines are counted only now, the valid inputs never pay for them.
+  long long line = 1, line_start = 0;
+  if (lex.resident()) {
+    const char *ptr = lex.data();
+    for (long long i = 0; i < offset; i++)
+      if (ptr[i] == '\n') {
+        line++;
+        line_start = i + 1;
+      }
+  }
+  else if (!file_path.empty()) {
+    std::ifstream ifs(file_path, std::ios::binary);
+    std::vector<char> block(1024 * 1024);
+    long long read = 0;
+    while (read < offset && ifs) {
+      ifs.read(block.data(), std::min((long long)block.size(), offset - read));
+      long long size = ifs.gcount();
+      for (long long i = 0; i < size; i++)
+        if (block[i] == '\n') {
+          line++;
+          line_start = read + i + 1;
+        }
+      read += size;
+      if (size == 0)
+        break;
+    }
+  }
+  else
+    return false;
+
+  _error_line = line;
+  _error_column = offset - line_start + 1;
+  return false;
+}
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Formatter
+///
+///===-----------------------------------------------------------------------===
+
+jsonhead::json_formatter::json_formatter(std::string file_path, json_input_mode mode)
+  : lex(file_path, 1024 * 1024 * 32, mode) {
+  lex.decode_numbers() = false;
+}
+
+jsonhead::json_formatter::json_formatter(std::unique_ptr<json_source> source, bool read_ahead)
+  : lex(std::move(source), 1024 * 1024 * 32, read_ahead) {
+  lex.decode_numbers() = false;
+}
+
+bool jsonhead::json_formatter::format(std::ostream& os, size_t buffer_size) {
+  json_writer writer(os, buffer_size);
+  writer.indent(_indent);
+  return format(writer);
+}
+
+bool jsonhead::json_formatter::format(json_writer& writer) {
+  this->writer = &writer;
+  depth = 0;
+  opened = false;
+  stack.clear();
+  stack.push_back(0);
+
+  while (!_error) {
+    if (!lex.next()) {
+      _error = true;
+      break;
+    }
+
+    auto type = lex.type();
+    int code;
+    // Reduce until the token is shifted, it is written then.
+    while ((code = json_goto_table[stack.back()][(int)type]) < 0) {
+      stack.resize(stack.size() - json_production[-code]);
+      stack.push_back(json_goto_table[stack.back()][json_group_table[-code]]);
+    }
+
+    if (code == json_accept_index)
+      break;
+    else if (code > 0) {
+      stack.push_back(code);
+      write(type);
+    }
+    else
+      _error = true;
+  }
+
+  if (_pretty && !_error)
+    writer.put('\n');
+  writer.flush();
+  return !_error;
+}
 
-  case 4:
-    contents.pop();
-    contents.pop();
-    break;
+void jsonhead::json_formatter::write(json_token type) {
+  // Closing an empty container keeps it on one line.
+  if (opened && type != json_token::object_ends && type != json_token::array_ends)
+    newline();
 
-  case 5:
-    contents.pop();
-    contents.pop();
-#ifndef CONFIG_ALLOCATOR
-    values.push(jobject(new json_object()));
-#else
-    values.push(jobject(jobject_pool.allocate()));
-#endif
-    break;
+  switch (type)
+  {
+  case json_token::object_starts:
+  case json_token::array_starts:
+    writer->put(type == json_token::object_starts ? '{' : '[');
+    depth++;
+    opened = true;
+    return;
 
-  case 6:
-    contents.pop();
-    contents.pop();
+  case json_token::object_ends:
+  case json_token::array_ends:
+    depth--;
+    if (!opened)
+      newline();
+    writer->put(type == json_token::object_ends ? '}' : ']');
     break;
 
-  case 7:
-    {
-#ifndef CONFIG_ALLOCATOR
-      auto jo = jobject(new json_object());
-#else
-      auto jo = jobject(jobject_pool.allocate());
-#endif
-      if (!(_skip_literal && values.top()->is_string()))
-#ifndef CONFIG_STABLE
-        jo->keyvalue[contents.top()] = std::move(values.top());
-#else
-        jo->keyvalue.push_back({contents.top(), std::move(values.top())});
-#endif
-#ifndef CONFIG_ALLOCATOR
-      else
-        
-#ifndef CONFIG_STABLE
-        jo->keyvalue[contents.top()] = std::shared_ptr<json_string>(new json_string(std::move(String())));
-#else
-        jo->keyvalue.push_back({contents.top(), std::shared_ptr<json_string>(new json_string(std::move(String())))});
-#endif
-#else
-      else
-#ifndef CONFIG_STABLE
-        jo->keyvalue[contents.top()] = jstring_pool.allocate(std::move(String()));
-#else
-        jo->keyvalue.push_back({contents.top(), jstring_pool.allocate(std::move(String()))});
-#endif
-#endif
-      values.pop();
-      values.push(jo);
-      contents.pop();
-    }
+  case json_token::v_comma:
+    writer->put(',');
+    newline();
     break;
 
-  case 8:
-    {
-      contents.pop();
-      auto jo = values.top(); values.pop();
-      if (!(_skip_literal && values.top()->is_string()))
-#ifndef CONFIG_STABLE
-        ((json_object*)&*jo)->keyvalue[contents.top()] = std::move(values.top());
-#else
-        ((json_object*)&*jo)->keyvalue.push_back({contents.top(), std::move(values.top())});
-#endif
-#ifndef CONFIG_ALLOCATOR
-      else
-#ifndef CONFIG_STABLE
-        ((json_object*)&*jo)->keyvalue[contents.top()] = std::shared_ptr<json_string>(new json_string(std::move(String())));
-#else
-        ((json_object*)&*jo)->keyvalue.push_back({contents.top(), std::shared_ptr<json_string>(new json_string(std::move(String())))});
-#endif
-#else
-      else
-#ifndef CONFIG_STABLE
-        ((json_object*)&*jo)->keyvalue[contents.top()] = jstring_pool.allocate(std::move(String()));
-#else
-        ((json_object*)&*jo)->keyvalue.push_back({contents.top(), jstring_pool.allocate(std::move(String()))});
-#endif
-#endif
-      values.pop();
-      values.push(jo);
-      contents.pop();
-    }
+  case json_token::v_pair:
+    if (_pretty)
+      writer->put(": ", 2);
+    else
+      writer->put(':');
     break;
 
-  case 9:
-    contents.pop();
+  case json_token::v_string:
+    // Already escaped in the input.
+    writer->put('"');
+    writer->put(lex.token(), lex.token_length());
+    writer->put('"');
     break;
 
-  case 10:
-    {
-#ifndef CONFIG_ALLOCATOR
-      auto ja = jarray(new json_array());
-#else
-      auto ja = jarray(jarray_pool.allocate());
-#endif
-      if (!(_skip_literal && values.top()->is_string()))
-        ja->array.push_back(values.top());
-      values.pop();
-      values.push(ja);
-    }
+  case json_token::v_number:
+    writer->put(lex.token(), lex.token_length());
     break;
 
-  case 11:
-    {
-      auto ja = values.top(); values.pop();
-      if (!(_skip_literal && values.top()->is_string()))
-        ((json_array*)&*ja)->array.push_back(values.top());
-      values.pop();
-      values.push(ja);
-      contents.pop();
-    }
-    break;
+  case json_token::v_true: writer->put("true", 4); break;
+  case json_token::v_false: writer->put("false", 5); break;
+  case json_token::v_null: writer->put("null", 4); break;
 
-  case 12:
-#ifndef CONFIG_ALLOCATOR
-    values.push(std::shared_ptr<json_string>(new json_string(contents.top())));
-#else
-    values.push(jstring_pool.allocate(contents.top()));
-#endif
-    contents.pop();
+  default:
     break;
+  }
+  opened = false;
+}
 
-  case 13:
-#ifndef CONFIG_ALLOCATOR
-    {
-      auto numeric = std::shared_ptr<json_numeric>(new json_numeric(contents.top()));
-#ifdef CONFIG_CHECK_INTEGER
-      if (!contents.top().Contains('.'))
-        numeric->is_integer = true;
-#endif
-      values.push(numeric);
+///===-----------------------------------------------------------------------===
+///
+///               Json Parallel Parser
+///
+///===-----------------------------------------------------------------------===
+
+// Commas of the root array near every fraction of the input.
+static std::vector<size_t> split_root_array(const char *data, size_t size, int count) {
+  std::vector<size_t> cuts;
+  jsonhead::json_structural_index index;
+  const size_t window = 1024 * 1024;
+  int depth = 0;
+
+  for (size_t base = 0; base < size && (int)cuts.size() < count - 1; base += window) {
+    index.index(data + base, std::min(window, size - base));
+    for (size_t i = 0; i < index.size(); i++) {
+      size_t position = base + index[i];
+      switch (data[position])
+      {
+      case '[':
+      case '{':
+        depth++;
+        break;
+      case ']':
+      case '}':
+        depth--;
+        break;
+      case ',':
+        if (depth == 1 && position >= size / count * (cuts.size() + 1)) {
+          cuts.push_back(position);
+          if ((int)cuts.size() == count - 1)
+            return cuts;
+        }
+        break;
+      }
     }
-#else
-    values.push(jnumeric_pool.allocate(contents.top()));
-#endif
-    contents.pop();
-    break;
+  }
+  return cuts;
+}
 
-  //case 14:
-  //case 15:
+jsonhead::json_parallel_parser::json_parallel_parser(std::string file_path, int threads)
+  : json_parallel_parser(std::unique_ptr<json_source>(new json_mmap_source(file_path)), threads) {
+}
 
-  case 16:
-#ifndef CONFIG_ALLOCATOR
-    values.push(std::shared_ptr<json_state>(new json_state(jsonhead::json_token::v_true)));
-#else
-    values.push(jstate_pool.allocate(jsonhead::json_token::v_true));
+jsonhead::json_parallel_parser::json_parallel_parser(std::unique_ptr<json_source> source, int threads)
+  : source(std::move(source)), threads(threads)
+#ifdef CONFIG_ALLOCATOR
+  , jarray_pool(1)
 #endif
-    contents.pop();
-    break;
+{
+  if (this->threads <= 0)
+    this->threads = std::max(1u, std::thread::hardware_concurrency());
+}
 
-  case 17:
-#ifndef CONFIG_ALLOCATOR
-    values.push(std::shared_ptr<json_state>(new json_state(jsonhead::json_token::v_false)));
-#else
-    values.push(jstate_pool.allocate(jsonhead::json_token::v_false));
-#endif
-    contents.pop();
-    break;
+void jsonhead::json_parallel_parser::configure(json_parser& parser) {
+  parser.skip_literal() = _skip_literal;
+  parser.keep_number_text() = _keep_number_text;
+  parser.structural_index() = _structural_index;
+}
+
+bool jsonhead::json_parallel_parser::parse_single() {
+  parsers.emplace_back(new json_parser(std::move(source)));
+  auto& parser = *parsers.back();
+  configure(parser);
+  while (parser.step());
+  _error = parser.error();
+  _entry = parser.entry();
+  return !_error;
+}
+
+bool jsonhead::json_parallel_parser::parse() {
+  if (!parsers.empty())
+    throw std::runtime_error("already parsed!");
+
+  const char *ptr = source->data();
+  size_t size = ptr != nullptr ? (size_t)source->size() : 0;
+  size_t root = 0;
+  while (root < size && (ptr[root] == ' ' || ptr[root] == '\t' || 
+                         ptr[root] == '\r' || ptr[root] == '\n'))
+    root++;
+  if (ptr == nullptr || threads == 1 || root == size || ptr[root] != '[')
+    return parse_single();
+
+  auto cuts = split_root_array(ptr, size, threads);
+  if (cuts.empty())
+    return parse_single();
+
+  // Chunks are lexed in place. The first chunk keeps the opening bracket
+  // and the last one the closing bracket of the root, the lexer returns
+  // the missing ones.
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i <= cuts.size(); i++) {
+    size_t begin = i == 0 ? 0 : cuts[i - 1] + 1;
+    size_t end = i == cuts.size() ? size : cuts[i];
+    parsers.emplace_back(new json_parser(std::unique_ptr<json_source>(
+      new json_memory_source(ptr + begin, end - begin))));
+    parsers.back()->lex.enclose(i != 0, i != cuts.size());
+    configure(*parsers.back());
+    workers.emplace_back([](json_parser *parser) { while (parser->step()); }, 
+                         parsers.back().get());
+  }
+  for (auto& worker : workers)
+    worker.join();
+
+  size_t count = 0;
+  for (auto& parser : parsers) {
+    if (parser->error() || !parser->entry() || !parser->entry()->is_array()) {
+      _error = true;
+      return false;
+    }
+    count += ((json_array *)&*parser->entry())->array.size();
+  }
 
-  case 18:
 #ifndef CONFIG_ALLOCATOR
-    values.push(std::shared_ptr<json_state>(new json_state(jsonhead::json_token::v_null)));
+  auto ja = jarray(new json_array());
 #else
-    values.push(jstate_pool.allocate(jsonhead::json_token::v_null));
+  auto ja = jarray(jarray_pool.allocate(data));
 #endif
-    contents.pop();
-    break;
+  // Elements are kept in reverse order, so the last chunk comes first.
+  ja->array.reserve(count);
+  for (auto it = parsers.rbegin(); it != parsers.rend(); it++) {
+    auto& elements = ((json_array *)&*(*it)->entry())->array;
+    ja->array.insert(ja->array.end(), elements.begin(), elements.end());
   }
+  _entry = ja;
+  return true;
 }
 
 ///===-----------------------------------------------------------------------===
@@ -794,6 +4255,27 @@ static bool check_safe_array(jsonhead::jtree_value dest, jsonhead::jtree_value s
 }
 #endif
 
+#ifndef CONFIG_STRICT
+// The type of a key found first in d1 and then in d2.
+static jsonhead::jtree_value merge_value(jsonhead::jtree_value d1, jsonhead::jtree_value d2) {
+using namespace jsonhead;
+  if (d1->type == json_tree_type::none)
+    return d2;
+#ifdef CONFIG_LAZY_CHECK
+  if (d1->type == json_tree_type::safe_array)
+    return select_safe_array(d1, d2);
+  if (d1->type == json_tree_type::object)
+    return select_object(d1, d2);
+#else
+  if (d1->type == json_tree_type::safe_array && check_safe_array(d1, d2))
+    return d2;
+  if (d1->type == json_tree_type::object && check_object(d1, d2))
+    return d2;
+#endif
+  return d1;
+}
+#endif
+
 jsonhead::jtree_safe_array jsonhead::json_tree_array::to_safe_array() {
   if (array.size() == 0) {
     return jtree_safe_array(new json_tree_safe_array(jtree_value(new json_tree_node(json_tree_type::none)), array.size()));
@@ -808,35 +4290,14 @@ jsonhead::jtree_safe_array jsonhead::json_tree_array::to_safe_array() {
       auto tob = ((json_tree_object*)(&*it));
       for (auto it = tob->keyvalue.rbegin(); it != tob->keyvalue.rend(); it++) {
         auto& kp = *it;
-#ifdef CONFIG_LAZY_CHECK
-        if (keypair.find(kp.first) == keypair.end()) {
-          obj->keyvalue.push_back({kp.first, kp.second});
-          keypair[kp.first] = keypair.size();
-        }
-        else if (obj->keyvalue[keypair[kp.first]].second->type == json_tree_type::none)
-          obj->keyvalue[keypair[kp.first]] = {kp.first, kp.second};
-        else if (obj->keyvalue[keypair[kp.first]].second->type == json_tree_type::safe_array)
-          obj->keyvalue[keypair[kp.first]] = {kp.first, select_safe_array(obj->keyvalue[keypair[kp.first]].second, kp.second)};
-        else if (obj->keyvalue[keypair[kp.first]].second->type == json_tree_type::object)
-          obj->keyvalue[keypair[kp.first]] = {kp.first, select_object(obj->keyvalue[keypair[kp.first]].second, kp.second)};
-#else
         if (keypair.find(kp.first) == keypair.end()) {
           obj->keyvalue.push_back({kp.first, kp.second});
           keypair[kp.first] = keypair.size();
         }
-        else if (obj->keyvalue[keypair[kp.first]].second->type == json_tree_type::none)
-          obj->keyvalue[keypair[kp.first]] = {kp.first, kp.second};
-        else if (obj->keyvalue[keypair[kp.first]].second->type == json_tree_type::safe_array)
-        {
-          if (check_safe_array(obj->keyvalue[keypair[kp.first]].second, kp.second))
-            obj->keyvalue[keypair[kp.first]] = {kp.first, kp.second};
-        }
-        else if (obj->keyvalue[keypair[kp.first]].second->type == json_tree_type::object)
-        {
-          if (check_object(obj->keyvalue[keypair[kp.first]].second, kp.second))
-            obj->keyvalue[keypair[kp.first]] = {kp.first, kp.second};
+        else {
+          auto& value = obj->keyvalue[keypair[kp.first]].second;
+          value = merge_value(value, kp.second);
         }
-#endif
       }
     }
 
@@ -948,18 +4409,26 @@ std::ostream& jsonhead::json_tree_object::print(std::ostream& os, std::string in
 
 jsonhead::json_tree::json_tree(jvalue entry) {
   if (entry->is_array() || entry->is_object()) {
+    _tree_entry = to_jtree_node(&*entry);
+  }
+  else
+    throw std::runtime_error("entry must be array or object type!");
+}
+
+jsonhead::json_tree::json_tree(const json_tape_ref& entry) {
+  if (entry.is_array() || entry.is_object()) {
     _tree_entry = to_jtree_node(entry);
   }
   else
     throw std::runtime_error("entry must be array or object type!");
 }
 
-jsonhead::jtree_value jsonhead::json_tree::to_jtree_node(jvalue value) {
+jsonhead::jtree_value jsonhead::json_tree::to_jtree_node(const json_value *value) {
   if (value->is_array()) {
-    return to_jtree_array(std::static_pointer_cast<json_array>(value));
+    return to_jtree_array((const json_array *)value);
   }
   else if (value->is_object()) {
-    return to_jtree_object(std::static_pointer_cast<json_object>(value));
+    return to_jtree_object((const json_object *)value);
   }
   else if (value->is_string()) {
     return jtree_value(new json_tree_node(json_tree_type::string));
@@ -968,7 +4437,7 @@ jsonhead::jtree_value jsonhead::json_tree::to_jtree_node(jvalue value) {
     return jtree_value(new json_tree_node(json_tree_type::numeric));
   }
   else if (value->is_keyword()) {
-    auto type = ((json_state*)&*value);
+    auto type = ((const json_state *)value);
     if (type->type == json_token::v_true || type->type == json_token::v_false)
       return jtree_value(new json_tree_node(json_tree_type::boolean));
     else if (type->type == json_token::v_null)
@@ -977,10 +4446,16 @@ jsonhead::jtree_value jsonhead::json_tree::to_jtree_node(jvalue value) {
   throw std::runtime_error("internal error!");
 }
 
-jsonhead::jtree_value jsonhead::json_tree::to_jtree_array(jarray array) {
+jsonhead::jtree_value jsonhead::json_tree::to_jtree_array(const json_array *array) {
   json_tree_array *arr = new json_tree_array();
+#ifdef CONFIG_COLUMNS
+  // Tree nodes keep the elements in reverse order like the parser does.
+  if (array->columns != nullptr)
+    for (size_t i = array->columns->rows; i > 0; i--)
+      arr->array.push_back(to_jtree_row(array->columns, i - 1));
+#endif
   for (auto it = array->array.begin(); it != array->array.end(); it++) {
-    arr->array.push_back(to_jtree_node(*it));
+    arr->array.push_back(to_jtree_node(&**it));
   }
 #ifdef CONFIG_COMPRESS
   if (arr->check_consistency()) {
@@ -992,12 +4467,256 @@ jsonhead::jtree_value jsonhead::json_tree::to_jtree_array(jarray array) {
   return jtree_value(arr);
 }
 
-jsonhead::jtree_object jsonhead::json_tree::to_jtree_object(jobject object) {
+jsonhead::jtree_object jsonhead::json_tree::to_jtree_object(const json_object *object) {
   json_tree_object* obj = new json_tree_object();
+#ifdef CONFIG_SHAPES
+  // Tree nodes keep the keys in reverse order like the parser does.
+  for (size_t i = object->size(); i > 0; i--)
+    obj->keyvalue.push_back({object->key(i - 1), to_jtree_node(&*object->value(i - 1))});
+#else
   for (auto it = object->keyvalue.begin(); it != object->keyvalue.end(); it++)
-    obj->keyvalue.push_back({it->first, to_jtree_node(it->second)});
+    obj->keyvalue.push_back({it->first, to_jtree_node(&*it->second)});
+#endif
+  return jtree_object(obj);
+}
+
+#ifdef CONFIG_COLUMNS
+jsonhead::jtree_value jsonhead::json_tree::to_jtree_node(const json_column& column, size_t row) {
+  switch (column.type)
+  {
+  case json_column_type::integer:
+  case json_column_type::floating:
+    return jtree_value(new json_tree_node(json_tree_type::numeric));
+  case json_column_type::boolean:
+    return jtree_value(new json_tree_node(json_tree_type::boolean));
+  case json_column_type::string:
+    return jtree_value(new json_tree_node(json_tree_type::string));
+  default:
+    return to_jtree_node(&*column.values[row]);
+  }
+}
+
+jsonhead::jtree_value jsonhead::json_tree::to_jtree_row(const json_columns *columns, size_t row) {
+  if (columns->shape == nullptr)
+    return to_jtree_node(columns->column(), row);
+  json_tree_object* obj = new json_tree_object();
+  for (size_t i = columns->shape->size; i > 0; i--)
+    obj->keyvalue.push_back({columns->shape->keys[i - 1], to_jtree_node(columns->column(i - 1), row)});
+  return jtree_object(obj);
+}
+#endif
+
+jsonhead::jtree_value jsonhead::json_tree::to_jtree_node(const json_tape_ref& value) {
+  // Tree nodes keep the children in reverse order like the parser does.
+  switch (value.type())
+  {
+  case json_tape_type::array:
+    {
+      json_tree_array *arr = new json_tree_array();
+      for (auto it = value.begin(), last = value.end(); it != last; ++it)
+        arr->array.push_back(to_jtree_node(it));
+      std::reverse(arr->array.begin(), arr->array.end());
+#ifdef CONFIG_COMPRESS
+      if (arr->check_consistency()) {
+        auto sa = arr->to_safe_array();
+        delete arr;
+        return sa;
+      }
+#endif
+      return jtree_value(arr);
+    }
+
+  case json_tape_type::object:
+    {
+      json_tree_object* obj = new json_tree_object();
+      for (auto it = value.begin(), last = value.end(); it != last; ++it) {
+        auto key = it;
+        ++it;
+        obj->keyvalue.push_back({key.str(), to_jtree_node(it)});
+      }
+      std::reverse(obj->keyvalue.begin(), obj->keyvalue.end());
+      return jtree_object(obj);
+    }
+
+  case json_tape_type::string:
+    return jtree_value(new json_tree_node(json_tree_type::string));
+
+  case json_tape_type::integer:
+  case json_tape_type::unsigned_integer:
+  case json_tape_type::floating:
+    return jtree_value(new json_tree_node(json_tree_type::numeric));
+
+  case json_tape_type::v_true:
+  case json_tape_type::v_false:
+    return jtree_value(new json_tree_node(json_tree_type::boolean));
+
+  case json_tape_type::v_null:
+    return jtree_value(new json_tree_node(json_tree_type::none));
+
+  default:
+    break;
+  }
+  throw std::runtime_error("internal error!");
+}
+
+static bool same_element(const jsonhead::jtree_value& e1, const jsonhead::jtree_value& e2) {
+  return *e1 == *e2 && *e2 == *e1;
+}
+
+jsonhead::json_schema_builder::json_schema_builder() {
+  // Leaves are never modified, so every one of a type is the same node.
+  for (int i = (int)json_tree_type::string; i <= (int)json_tree_type::none; i++)
+    scalars[i] = jtree_value(new json_tree_node((json_tree_type)i));
+}
+
+void jsonhead::json_schema_builder::start_object() {
+  frames.push_back(frame());
+  frames.back().is_array = false;
+}
+
+void jsonhead::json_schema_builder::end_object() {
+  json_tree_object* obj = new json_tree_object();
+  auto& members = frames.back().members;
+  // Tree nodes keep the keys in reverse order like the parser does.
+  obj->keyvalue.assign(members.rbegin(), members.rend());
+  frames.pop_back();
+  value(jtree_object(obj));
+}
+
+void jsonhead::json_schema_builder::start_array() {
+  frames.push_back(frame());
+  frames.back().is_array = true;
+}
+
+void jsonhead::json_schema_builder::end_array() {
+  frame& f = frames.back();
+  jtree_value node;
+#ifdef CONFIG_COMPRESS
+#ifdef CONFIG_DISABLE_TOP_LEVEL_COMPRESS
+  if (f.element != nullptr && (f.element->type == json_tree_type::string ||
+      f.element->type == json_tree_type::numeric || f.element->type == json_tree_type::boolean))
+    f.consistent = false;
+#endif
+  if (f.consistent) {
+    jtree_value element = f.merged.empty() ? f.element : merged_object(f);
+    if (element == nullptr)
+      element = scalars[(int)json_tree_type::none];
+    node = jtree_safe_array(new json_tree_safe_array(element, f.count));
+  }
+  else
+#endif
+  {
+    json_tree_array *arr = new json_tree_array();
+    arr->array.assign(f.elements.rbegin(), f.elements.rend());
+    node = jtree_value(arr);
+  }
+  frames.pop_back();
+  value(node);
+}
+
+void jsonhead::json_schema_builder::key(const char *str, size_t len) {
+  frames.back().key = String(str, len);
+}
+
+void jsonhead::json_schema_builder::string(const char *, size_t) {
+  value(scalars[(int)json_tree_type::string]);
+}
+
+void jsonhead::json_schema_builder::number(const json_number&) {
+  value(scalars[(int)json_tree_type::numeric]);
+}
+
+void jsonhead::json_schema_builder::boolean(bool) {
+  value(scalars[(int)json_tree_type::boolean]);
+}
+
+void jsonhead::json_schema_builder::null() {
+  value(scalars[(int)json_tree_type::none]);
+}
+
+void jsonhead::json_schema_builder::value(jtree_value node) {
+  if (frames.empty()) {
+    if (node->type != json_tree_type::safe_array && node->type != json_tree_type::array &&
+        node->type != json_tree_type::object)
+      throw std::runtime_error("entry must be array or object type!");
+    _tree_entry = node;
+    return;
+  }
+
+  frame& f = frames.back();
+  if (!f.is_array) {
+    f.members.push_back({f.key, node});
+    return;
+  }
+
+  f.count++;
+#ifdef CONFIG_COMPRESS
+  // A heterogeneous array needs its elements, without CONFIG_COMPRESS
+  // every array does like in json_tree.
+  if (f.elements.size() < _element_limit)
+#endif
+    f.elements.push_back(node);
+#ifdef CONFIG_COMPRESS
+  if (!f.consistent)
+    return;
+
+  if (node->type == json_tree_type::none) {
+    f.consistent = f.element == nullptr || same_element(f.element, node);
+    f.nulls = true;
+  }
+  else {
+    if (f.element != nullptr)
+      f.consistent = same_element(f.element, node);
+    else if (f.nulls)
+      f.consistent = same_element(scalars[(int)json_tree_type::none], node);
+    f.element = node;
+#ifndef CONFIG_STRICT
+    if (f.consistent && node->type == json_tree_type::object)
+      merge(f, node);
+#endif
+  }
+
+  if (!f.consistent) {
+    f.keypair.clear();
+    f.merged.clear();
+  }
+#endif
+}
+
+#ifndef CONFIG_STRICT
+// to_safe_array merges from the last element of the document, so here the
+// newer element comes first and the keys are ordered by where they were
+// found last when the array ends.
+void jsonhead::json_schema_builder::merge(frame& f, jtree_value node) {
+  auto tob = ((json_tree_object*)(&*node));
+  size_t position = 0;
+  for (auto it = tob->keyvalue.rbegin(); it != tob->keyvalue.rend(); it++, position++) {
+    auto& kp = *it;
+    auto found = f.keypair.find(kp.first);
+    if (found == f.keypair.end()) {
+      f.keypair[kp.first] = f.merged.size();
+      f.merged.push_back({kp.first, kp.second, f.count, position});
+    }
+    else {
+      auto& mk = f.merged[found->second];
+      mk.value = merge_value(kp.second, mk.value);
+      mk.element = f.count;
+      mk.position = position;
+    }
+  }
+}
+
+jsonhead::jtree_value jsonhead::json_schema_builder::merged_object(frame& f) {
+  std::sort(f.merged.begin(), f.merged.end(), [](const merged_key& k1, const merged_key& k2) {
+    return k1.element != k2.element ? k1.element > k2.element : k1.position < k2.position;
+  });
+  json_tree_object* obj = new json_tree_object();
+  obj->print_reverse = true;
+  for (auto& mk : f.merged)
+    obj->keyvalue.push_back({mk.key, mk.value});
   return jtree_object(obj);
 }
+#endif
 
 jsonhead::json_tree_exporter::json_tree_exporter(jtree_value tree_entry)
   : _tree_entry(tree_entry) {
@@ -14,11 +14,18 @@
 #include "String.h"
 #include "StringBuilder.h"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
 #include <fstream>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <stack>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <vector>
 #include <ostream>
@@ -29,7 +36,23 @@
 #define CONFIG_COMPRESS
 //#define CONFIG_DISABLE_TOP_LEVEL_COMPRESS
 #define CONFIG_LAZY_CHECK
-//#define CONFIG_CHECK_INTEGER
+// Keep every node in arenas owned by json_parser instead of shared_ptr.
+#define CONFIG_ALLOCATOR
+// Objects with the same keys in the same order share one json_shape and
+// keep only their values. Needs CONFIG_ALLOCATOR and CONFIG_STABLE.
+#define CONFIG_SHAPES
+// Arrays of numbers, booleans, strings or flat objects of one shape may be
+// stored by column, see json_parser::columnar(). Needs CONFIG_SHAPES.
+#define CONFIG_COLUMNS
+// Set by CMake when zlib is found.
+//#define CONFIG_GZIP
+
+#if !defined(CONFIG_ALLOCATOR) || !defined(CONFIG_STABLE)
+#undef CONFIG_SHAPES
+#endif
+#ifndef CONFIG_SHAPES
+#undef CONFIG_COLUMNS
+#endif
 
 namespace jsonhead {
 
@@ -64,94 +87,823 @@ typedef enum class _json_token {
 ///
 ///===-----------------------------------------------------------------------===
 
-template<typename type>
-class json_allocator {
-  size_t capacity;
-  
-  using pointer = type *;
-  using value_size = /*alignas(alignof(type))*/ unsigned char[sizeof(type)];
+// Bump allocator over large blocks. Nothing is freed one by one, rewind()
+// and clear() release every allocation after a mark at once.
+class json_arena {
+  size_t block_size;
+  std::vector<std::pair<std::unique_ptr<char[]>, size_t>> blocks;
+  size_t block = 0;
+  size_t offset = 0;
 
-  class allocator_node {
-  public:
-    typename value_size value;
-    constexpr pointer rep() { return reinterpret_cast<pointer>(value); }
-  };
+public:
+  typedef std::pair<size_t, size_t> mark_type;
+
+  json_arena(size_t block_size = 1024 * 1024) : block_size(block_size) {}
+  json_arena(const json_arena&) = delete;
+  json_arena& operator=(const json_arena&) = delete;
+
+  void *allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+    if (!blocks.empty()) {
+      uintptr_t base = (uintptr_t)blocks[block].first.get();
+      size_t aligned = ((base + offset + align - 1) & ~(uintptr_t)(align - 1)) - base;
+      if (aligned + size <= blocks[block].second) {
+        offset = aligned + size;
+        return (void *)(base + aligned);
+      }
+    }
+    return allocate_block(size, align);
+  }
+
+  char *allocate_string(const char *str, size_t len);
 
-  std::vector<std::unique_ptr<allocator_node[]>> alloc;
-  int count;
+  mark_type mark() const { return mark_type(block, offset); }
+  // Blocks are kept for the following allocations.
+  void rewind(mark_type mark) { block = mark.first; offset = mark.second; }
+  void clear() { blocks.clear(); block = offset = 0; }
+  size_t reserved() const;
 
+private:
+  void *allocate_block(size_t size, size_t align);
+};
+
+// Standard allocator interface over json_arena for the containers of the
+// nodes. Memory comes back only with the arena.
+template<typename type>
+class json_arena_allocator {
 public:
+  using value_type = type;
+  json_arena *arena;
 
-  json_allocator(size_t capacity) : capacity(capacity), count(0) {
-    alloc.push_back(std::unique_ptr<allocator_node[]>(std::move(new allocator_node[capacity])));
-    count = 0;
-  }
+  json_arena_allocator(json_arena& arena) : arena(&arena) {}
+  template<typename other>
+  json_arena_allocator(const json_arena_allocator<other>& alloc) : arena(alloc.arena) {}
 
-  ~json_allocator() {
-    for (int i = 0; i < alloc.size() - 1; i++)
-      for (int j = 0; j < capacity; j++)
-        alloc[i][j].rep()->type::~type();
-    for (int j = 0; j < count; j++)
-        alloc.back()[j].rep()->type::~type();
-  }
+  type *allocate(size_t n) { return (type *)arena->allocate(n * sizeof(type), alignof(type)); }
+  void deallocate(type *, size_t) {}
+
+  template<typename other>
+  bool operator==(const json_arena_allocator<other>& alloc) const { return arena == alloc.arena; }
+  template<typename other>
+  bool operator!=(const json_arena_allocator<other>& alloc) const { return arena != alloc.arena; }
+};
+
+// Nodes of one type side by side. Destructors are never called, so the
+// types must keep their memory in a json_arena.
+template<typename type>
+class json_allocator {
+  json_arena arena;
+
+public:
+  json_allocator(size_t capacity) : arena(capacity * sizeof(type)) {}
 
   template <typename... Args>
-  pointer allocate(Args&& ... args) {
-    if (count == capacity) {
-      alloc.push_back(std::unique_ptr<allocator_node[]>(std::move(new allocator_node[capacity])));
-      count = 0;
-    }
-    pointer ptr = alloc.back()[count++].rep();
-    new (ptr) type(std::forward<Args>(args)...);
-    return ptr;
+  type *allocate(Args&& ... args) {
+    return new (arena.allocate(sizeof(type), alignof(type))) type(std::forward<Args>(args)...);
   }
+
+  json_arena::mark_type mark() const { return arena.mark(); }
+  void rewind(json_arena::mark_type mark) { arena.rewind(mark); }
+};
+
+// Keys of objects in document order, shared by every object with the
+// same keys in the same order. Looked up through a hash index.
+class json_shape {
+public:
+  size_t size = 0;
+  const String *keys = nullptr;
+  // Open addressing over the key hashes, position + 1 or 0.
+  const uint32_t *index = nullptr;
+  size_t mask = 0;
+
+  static const size_t npos = (size_t)-1;
+
+  // Position of the key, the first one when it is repeated.
+  size_t find(const char *key, size_t len) const;
+
+  // Keys are copied as views of the same text.
+  static json_shape *create(json_arena& arena, const String *keys, size_t size);
+  static const json_shape *empty();
+};
+
+// Object keys stored once each, the entries of json_object refer the
+// stored copy. Ids are given in order from 0. A table may be shared by
+// parsers running one after another, and is never rewound with them.
+class json_symbol_table {
+  json_arena arena;
+  std::vector<String> names;
+  std::vector<uint64_t> hashes;
+  // Open addressing, id + 1 or 0 for an empty slot.
+  std::vector<uint32_t> slots;
+  size_t limit;
+
+public:
+  static const uint32_t npos = (uint32_t)-1;
+
+  // Keys past the limit are not interned, so tables do not grow without
+  // bound on keys which are really data, like ids.
+  json_symbol_table(size_t limit = 1024 * 1024) : arena(64 * 1024), limit(limit) {}
+
+  // Returns npos for a new key when the table is full.
+  uint32_t intern(const char *ptr, size_t len);
+  uint32_t find(const char *ptr, size_t len) const;
+
+  const String& name(uint32_t id) const { return names[id]; }
+  size_t size() const { return names.size(); }
+  size_t memory_usage() const;
+
+  // The shape of the interned keys in this order, nullptr when it is new
+  // and the table is full.
+  const json_shape *shape(const uint32_t *ids, size_t count);
+  size_t shapes() const { return shape_list.size(); }
+
+  static uint64_t hash(const char *ptr, size_t len);
+
+private:
+  std::vector<const json_shape *> shape_list;
+  std::vector<uint64_t> shape_hashes;
+  std::vector<uint32_t> shape_slots;
+
+  void grow();
+  void grow_shapes();
+};
+#endif
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Structural Index
+///
+///===-----------------------------------------------------------------------===
+
+// Stage 1 of the lexer. Classifies 64 bytes at a time (AVX2, SSE2 or
+// scalar) and records the offset of every structural character, every
+// opening quote and every first byte of a number or keyword. Strings are
+// tracked across blocks, so structural characters inside strings are
+// never reported. Spans may be indexed piecewise; the carry state of
+// the previous span is kept between calls.
+class json_structural_index {
+  uint64_t prev_in_string = 0;
+  uint64_t prev_escaped = 0;
+  uint64_t prev_scalar = 0;
+  std::vector<uint32_t> positions;
+
+public:
+  void reset();
+
+  // Append the structural positions of [ptr, ptr + size) relative to ptr.
+  // Previous positions are discarded.
+  void index(const char *ptr, size_t size);
+
+  size_t size() const { return positions.size(); }
+  uint32_t operator[](size_t index) const { return positions[index]; }
+  const std::vector<uint32_t>& get() const { return positions; }
+
+  bool in_string() const { return prev_in_string != 0; }
+
+  // Continue at ptr with the given quote state, the escape and scalar
+  // states are taken from the bytes in [begin, ptr).
+  void resume(const char *begin, const char *ptr, bool in_string);
+  void swap(json_structural_index& other);
+
+  // Index consecutive windows of [ptr, ptr + size) on one thread each.
+  // Windows are indexed from both quote states at once, the real state of
+  // every window is then resolved in order. Continues from this index.
+  void index_parallel(const char *begin, const char *ptr, size_t size, 
+                      size_t window, std::vector<json_structural_index>& windows);
+
+private:
+  friend class json_document;
+  void index_block(const char *ptr, size_t len, uint32_t offset);
+};
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Source
+///
+///===-----------------------------------------------------------------------===
+
+typedef enum class _json_input_mode {
+  stream,     // sequential reads into one buffer on the parsing thread
+  memory_map, // whole file mapped read-only
+  read_ahead, // blocks are read by a background thread while lexing
+} json_input_mode;
+
+// Where the lexer gets its bytes from. Sequential sources only implement
+// read(); sources holding the whole input in memory also return it from
+// data(), and the lexer walks it without copying.
+class json_source {
+protected:
+  // Bytes taken from the underlying medium, compressed bytes for gzip.
+  // Updated by the reading thread, read by the parsing thread.
+  std::atomic<long long> consumed_size{0};
+
+public:
+  virtual ~json_source() {}
+
+  // Read up to `size` bytes. Returns less than `size` only at the end.
+  virtual long long read(char *buffer, long long size) = 0;
+
+  // Size of the json text, -1 when it is not known in advance.
+  virtual long long size() const { return -1; }
+  // Size of the underlying medium, -1 when it is not known either.
+  virtual long long total() const { return size(); }
+  virtual const char *data() const { return nullptr; }
+
+  long long consumed() const { return consumed_size; }
+};
+
+class json_file_source : public json_source {
+  std::ifstream ifs;
+  long long file_size;
+
+public:
+  json_file_source(const std::string& file_path);
+
+  long long read(char *buffer, long long size) override;
+  long long size() const override { return file_size; }
+};
+
+class json_mmap_source : public json_source {
+  char *map = nullptr;
+  long long file_size = 0;
+#ifdef _OS_WINDOWS
+  void *file_handle = nullptr;
+  void *map_handle = nullptr;
+#endif
+
+public:
+  json_mmap_source(const std::string& file_path);
+  ~json_mmap_source();
+
+  long long read(char *buffer, long long size) override;
+  long long size() const override { return file_size; }
+  const char *data() const override { return map; }
+
+private:
+  void unmap();
+};
+
+// Refers memory owned by the caller, which must outlive the lexer.
+class json_memory_source : public json_source {
+  const char *ptr;
+  long long length;
+
+public:
+  json_memory_source(const char *ptr, size_t length);
+
+  long long read(char *buffer, long long size) override;
+  long long size() const override { return length; }
+  const char *data() const override { return ptr; }
+};
+
+// Unseekable file descriptor such as a pipe or stdin (fd 0).
+class json_fd_source : public json_source {
+  int fd;
+  bool owns;
+
+public:
+  json_fd_source(int fd, bool close_on_destroy = false);
+  ~json_fd_source();
+
+  long long read(char *buffer, long long size) override;
+};
+
+#ifdef CONFIG_GZIP
+// Inflates a gzip stream while reading. The uncompressed size is unknown,
+// so progress is reported in compressed bytes through consumed()/total().
+class json_gzip_source : public json_source {
+  void *file;
+  long long compressed_size = -1;
+
+public:
+  json_gzip_source(const std::string& file_path);
+  json_gzip_source(int fd);
+  ~json_gzip_source();
+
+  long long read(char *buffer, long long size) override;
+  long long total() const override { return compressed_size; }
 };
 #endif
 
+// Reads a source into a ring of blocks on a background thread. Every block
+// reserves `headroom` bytes in front of its data, so the lexer can put the
+// unfinished token of the previous block right before the new data.
+class json_readahead {
+  struct block {
+    std::unique_ptr<char[]> memory;
+    long long size = 0;
+  };
+
+  json_source& source;
+  long long block_size;
+  long long headroom;
+  std::vector<block> blocks;
+
+  // Blocks are filled, acquired and released in order.
+  long long filled = 0;
+  long long acquired = 0;
+  long long released = 0;
+  bool finished = false;
+  bool stopping = false;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::thread worker;
+
+public:
+  json_readahead(json_source& source, long long block_size, long long headroom,
+                 int count = 2);
+  ~json_readahead();
+
+  // Waits for the next block. Returns nullptr at the end of the source.
+  char *acquire(long long& size);
+  // Gives the oldest acquired block back to the reader.
+  void release();
+
+  long long capacity() const { return block_size; }
+  long long reserved() const { return headroom; }
+
+private:
+  void run();
+};
+
 ///===-----------------------------------------------------------------------===
 ///
 ///               Json Lexer
 ///
 ///===-----------------------------------------------------------------------===
 
+// Text of a token as an offset and length into the input mapping, or into
+// the parser's token scratch when the input is read through a buffer.
+struct json_slice {
+  size_t offset = 0;
+  size_t length = 0;
+  bool escaped = false;
+};
+
+// Returns the first '"' or '\\' in [ptr, end). Scans 32 or 16 bytes at a
+// time where available. Control characters are left to the strict() check.
+const char *json_scan_string(const char *ptr, const char *end);
+// Returns the first byte in [ptr, end) which is not json whitespace.
+const char *json_skip_whitespace(const char *ptr, const char *end);
+
+// Decode the escape sequences of a string token body into UTF-8.
+String json_unescape(const char *ptr, size_t len);
+// Decodes into dest, which needs len + 1 bytes. Returns the decoded length,
+// the terminating null is not written.
+size_t json_unescape(char *dest, const char *ptr, size_t len);
+
+typedef enum class _json_number_type {
+  integer,          // fits int64_t
+  unsigned_integer, // above INT64_MAX, fits uint64_t
+  floating,         // fraction, exponent or out of integer range
+} json_number_type;
+
+struct json_number {
+  json_number_type type = json_number_type::integer;
+  union {
+    int64_t i = 0;
+    uint64_t u;
+    double d;
+  };
+
+  int64_t to_int64() const;
+  uint64_t to_uint64() const;
+  double to_double() const;
+  // False for a double which overflowed to inf, like 1e400.
+  bool finite() const;
+};
+
+// Decode a number token. Eight digits are converted at once (SWAR), and
+// doubles take the exact fast path when the mantissa and exponent allow
+// it, falling back to strtod otherwise. Exponents out of the range of
+// double give inf, see json_number::finite().
+bool json_parse_number(const char *ptr, size_t len, json_number& number);
+
 class json_lexer {
   json_token curtok;
-  String curstr;
+
+  // Token text inside `buffer`. String tokens exclude the quotes.
+  char *token_begin = nullptr;
+  size_t token_size = 0;
+  bool token_escape = false;
+  bool token_skip = false;
+  json_number token_number;
+  bool _decode_numbers = true;
+  bool _strict = false;
+  long long _error_position = -1;
   
   long long file_size;
   long long read_size = 0;
   long long buffer_size;
   long long current_block_size = 0;
-  char *buffer;
+  char *buffer = nullptr;
   char *pointer = nullptr;
 
-  std::ifstream ifs;
+  std::unique_ptr<json_source> source;
 
   bool appendable = true;
 
+  // Jump from token to token through the structural index instead of
+  // classifying every byte in next().
+  bool _structural = false;
+  int _index_threads = 1;
+  json_structural_index index;
+  // Windows indexed ahead by the other threads.
+  std::vector<json_structural_index> index_windows;
+  size_t index_window = 0;
+  size_t index_cursor = 0;
+  char *index_base = nullptr;
+  char *index_end = nullptr;
+
+  // No more bytes can be read after the current block.
+  bool input_end = false;
+  // next_ch() ran out of input, the 0 it returned is not a NUL byte.
+  bool exhausted = false;
+
+  // The whole input is in memory at `buffer`, no refresh required.
+  bool in_memory = false;
+
+  // `buffer` is a block of the read-ahead ring, or `spill` when the
+  // unfinished token did not fit into the headroom of the block.
+  std::unique_ptr<json_readahead> readahead;
+  bool holding_block = false;
+  std::vector<char> spill;
+
+  // Input pushed with feed(). An unfinished token at the end of a chunk
+  // is kept in `pending` and completed with the head of the next chunk,
+  // the rest of which is lexed in place.
+  bool pushing = false;
+  bool push_finished = false;
+  bool starved = false;
+  std::vector<char> pending;
+  const char *rest = nullptr;
+  size_t rest_size = 0;
+
+  // Brackets not in the input returned around its tokens.
+  bool enclose_open = false;
+  bool enclose_close = false;
+
+  // Line breaks in the whitespace skipped since the last token.
+  bool _track_lines = false;
+  bool newline_seen = false;
+  bool _line_break = false;
+
 public:
-  json_lexer(std::string file_path, long long buffer_size = 1024 * 1024 * 32);
+  json_lexer(std::string file_path, long long buffer_size = 1024 * 1024 * 32,
+             json_input_mode mode = json_input_mode::stream);
+  json_lexer(std::unique_ptr<json_source> source, 
+             long long buffer_size = 1024 * 1024 * 32, bool read_ahead = false);
+  // Push mode, the input is given with feed() and ended with finish().
+  json_lexer();
   ~json_lexer();
 
-  bool next();
+  // Tokens of pushed input run until the end of the chunk, then next()
+  // gives json_token::none until more is fed. The chunk must stay valid
+  // until then.
+  void feed(const char *ptr, size_t len);
+  void finish();
 
-  inline json_token type() const;
-  inline String str();
+  // Return '[' before the first token and ']' after the last one, so a
+  // slice of the elements of an array is lexed as an array of its own.
+  void enclose(bool open, bool close) { enclose_open = open; enclose_close = close; }
+
+  bool next();
+  // Skip the next value by bracket depth without lexing what is inside,
+  // it reads as a null token with skipped() set. Other tokens are
+  // returned as by next(), and so are objects and arrays when containers
+  // is cleared.
+  bool skip_value(bool containers = true);
+
+  json_token type() const { return curtok; }
+  String str() const { return token_escape ? json_unescape(token_begin, token_size)
+                                            : String((const char *)token_begin, token_size); }
+
+  // The token text stays valid until the next call of next(), or for the
+  // lifetime of the lexer when the input is resident().
+  const char *token() const { return token_begin; }
+  size_t token_length() const { return token_size; }
+  bool token_escaped() const { return token_escape; }
+  bool skipped() const { return token_skip; }
+  const json_number& number() const { return token_number; }
+  const char *data() const { return buffer; }
 
   const char *gbuffer() const;
 
-  std::ifstream &stream() { return ifs; }
+  json_source &input() { return *source; }
 
+  // -1 when the size is not known, as for pipes and gzip streams.
   long long filesize() const { return file_size; }
   long long readsize() const { return read_size; }
+  bool resident() const { return in_memory; }
+  bool &structural_index() { return _structural; }
+  // Threads building the structural index of resident input.
+  int &index_threads() { return _index_threads; }
+  // Number tokens are only checked and number() is not set when cleared.
+  bool &decode_numbers() { return _decode_numbers; }
+  // Reject what the grammar of RFC 8259 does not allow but the lexer lets
+  // through otherwise: leading zeros, unknown escapes, control characters
+  // and malformed UTF-8 in strings.
+  bool &strict() { return _strict; }
+  // Note whether whitespace before each token held a line break, read
+  // with line_break(). Off by default, it costs a scan of every run.
+  bool &track_line_breaks() { return _track_lines; }
+  bool line_break() const { return _line_break; }
 
   long long position() const { return read_size - current_block_size + (pointer - buffer); }
+  // Offset of the first byte of the current token, the quote of strings.
+  // After next() failed, where the invalid token starts.
+  long long token_position() const;
+  // After next() failed, the offset of the first invalid byte when strict()
+  // found it, token_position() otherwise.
+  long long error_position() const 
+    { return _error_position >= 0 ? _error_position : token_position(); }
+
+  // Progress in bytes of the json text, or of the underlying medium when
+  // the text size is unknown (compressed bytes for gzip).
+  long long progress_position() const 
+    { return file_size >= 0 || !source ? position() : source->consumed(); }
+  long long progress_size() const 
+    { return file_size >= 0 || !source ? file_size : source->total(); }
 
 private:
+  bool lex_token();
+  bool push_next();
+  void push_block(const char *ptr, size_t len);
   void buffer_refresh();
+  long long stream_refresh(long long carry);
+  long long readahead_refresh(long long carry);
   bool require_refresh();
+  bool seek_structural();
   char next_ch();
   void prev();
+  bool strict_error(const char *ptr);
+};
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Writer
+///
+///===-----------------------------------------------------------------------===
+
+// Serializes json into a large buffer, which is handed to the ostream or
+// written to the file descriptor (write(2)) when it is full, on flush()
+// and when the writer is destroyed.
+class json_writer {
+  std::ostream *os = nullptr;
+  int fd = -1;
+  bool owns = false;
+  bool _error = false;
+  size_t capacity;
+  std::unique_ptr<char[]> buffer;
+  size_t size = 0;
+  // The prefix of every line followed by the indentation repeated for the
+  // deepest level so far, newline() writes a slice of it.
+  std::string _indent = "  ";
+  std::string indents;
+  size_t prefix = 0;
+
+public:
+  json_writer(std::ostream& os, size_t buffer_size = 1024 * 1024);
+  json_writer(int fd, size_t buffer_size = 1024 * 1024);
+  // Creates or truncates the file.
+  json_writer(const std::string& file_path, size_t buffer_size = 1024 * 1024);
+  ~json_writer();
+
+  // Indentation of one level, and what every line after the first starts with.
+  void indent(const std::string& unit, const std::string& prefix = "");
+  // Writing to the file descriptor failed.
+  bool error() const { return _error; }
+
+  void put(char ch) { if (size == capacity) flush(); buffer[size++] = ch; }
+  void put(const char *ptr, size_t len);
+  // A line break and the indentation of depth.
+  void newline(size_t depth);
+  // Quoted, with '"', '\\' and control characters escaped.
+  void string(const char *ptr, size_t len);
+  void string(const String& str) { string(str.Reference(), str.Length()); }
+  void number(const json_number& number);
+  void integer(int64_t value);
+  void unsigned_integer(uint64_t value);
+  // Shortest of 15 or 17 significant digits that reads back the same, and
+  // always with a fraction or an exponent. Json has no inf or nan, they are
+  // written as null.
+  void floating(double value);
+  void flush();
+
+private:
+  void write_out(const char *ptr, size_t len);
+};
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Tape
+///
+///===-----------------------------------------------------------------------===
+
+// Every value is a 64-bit word with the type in the top 8 bits.
+//   { [     payload is the index of the matching end word
+//   } ]     payload is the number of members or elements
+//   "       payload is the offset of the string in the string arena
+//   l u d   the next word holds the int64, uint64 or double value
+//   t f n   true, false and null
+// Members of an object are a string word followed by the value.
+typedef enum class _json_tape_type : unsigned char {
+  object = '{',
+  object_ends = '}',
+  array = '[',
+  array_ends = ']',
+  string = '"',
+  integer = 'l',
+  unsigned_integer = 'u',
+  floating = 'd',
+  v_true = 't',
+  v_false = 'f',
+  v_null = 'n',
+} json_tape_type;
+
+class json_tape;
+
+class json_tape_ref {
+  const json_tape *tape;
+  size_t index;
+
+public:
+  json_tape_ref(const json_tape *tape, size_t index) : tape(tape), index(index) {}
+
+  json_tape_type type() const;
+  bool is_object() const { return type() == json_tape_type::object; }
+  bool is_array() const { return type() == json_tape_type::array; }
+  bool is_string() const { return type() == json_tape_type::string; }
+  bool is_numeric() const { 
+    auto t = type();
+    return t == json_tape_type::integer || t == json_tape_type::unsigned_integer || 
+           t == json_tape_type::floating;
+  }
+  bool is_keyword() const {
+    auto t = type();
+    return t == json_tape_type::v_true || t == json_tape_type::v_false || 
+           t == json_tape_type::v_null;
+  }
+
+  // Members of an object or elements of an array.
+  size_t size() const;
+  json_tape_ref at(size_t i) const;
+  json_tape_ref operator[](const char *key) const;
+
+  json_number number() const;
+  const char *c_str() const;
+  size_t length() const;
+  String str() const { return String(c_str(), length()); }
+
+  // Children in document order, an object yields each key followed by
+  // its value.
+  json_tape_ref begin() const { return json_tape_ref(tape, index + 1); }
+  json_tape_ref end() const;
+  json_tape_ref next() const;
+
+  json_tape_ref& operator++() { *this = next(); return *this; }
+  const json_tape_ref& operator*() const { return *this; }
+  bool operator==(const json_tape_ref& ref) const { return index == ref.index; }
+  bool operator!=(const json_tape_ref& ref) const { return index != ref.index; }
+  size_t position() const { return index; }
+
+  std::ostream& print(std::ostream& os, bool format = false, std::string indent = "") const;
+  void write(json_writer& writer, bool format = false, size_t depth = 0) const;
+};
+
+class json_tape {
+  friend class json_tape_ref;
+  std::vector<uint64_t> tape;
+  std::vector<char> strings;
+  std::vector<size_t> open_containers;
+  std::vector<uint64_t> commas;
+
+public:
+  void clear();
+  bool empty() const { return tape.empty(); }
+  size_t size() const { return tape.size(); }
+  size_t memory_usage() const { return tape.size() * sizeof(uint64_t) + strings.size(); }
+
+  // The root value, the current record in json lines mode.
+  json_tape_ref root() const { return json_tape_ref(this, 0); }
+  std::ostream& print(std::ostream& os, bool format = false, std::string indent = "") const 
+    { return root().print(os, format, indent); }
+
+  // Building, the parser calls these in document order.
+  void open(json_tape_type type);
+  void close();
+  void next_element() { commas.back()++; }
+  void append_string(const char *ptr, size_t len, bool escaped);
+  void append_number(const json_number& number);
+  void append_keyword(json_tape_type type);
+
+private:
+  void append(json_tape_type type, uint64_t payload) 
+    { tape.push_back(((uint64_t)type << 56) | payload); }
+};
+
+inline json_tape_type json_tape_ref::type() const {
+  return (json_tape_type)(tape->tape[index] >> 56);
+}
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Document
+///
+///===-----------------------------------------------------------------------===
+
+class json_document;
+
+// A value of a json_document, decoded only when it is read. Walking to a
+// sibling skips the values in between through the structural index by
+// bracket depth. Syntax errors are only found in the values that are read.
+class json_cursor {
+  const json_document *doc;
+  size_t index;
+
+public:
+  json_cursor(const json_document *doc, size_t index) : doc(doc), index(index) {}
+
+  // object_starts, array_starts, v_string, v_number, v_true, v_false,
+  // v_null, or error.
+  json_token type() const;
+  bool is_object() const { return type() == json_token::object_starts; }
+  bool is_array() const { return type() == json_token::array_starts; }
+  bool is_string() const { return type() == json_token::v_string; }
+  bool is_numeric() const { return type() == json_token::v_number; }
+  bool is_keyword() const { 
+    auto t = type();
+    return t == json_token::v_true || t == json_token::v_false || t == json_token::v_null;
+  }
+  bool is_null() const { return type() == json_token::v_null; }
+
+  // Members of an object or elements of an array. Both walk the children
+  // from the first one; iterate to visit every child in a single pass.
+  size_t size() const;
+  json_cursor at(size_t i) const;
+  json_cursor operator[](size_t i) const { return at(i); }
+  // Literal 0 would be ambiguous with the key overload.
+  json_cursor operator[](int i) const { return at((size_t)i); }
+  json_cursor operator[](const char *key) const;
+  bool find(const char *key, json_cursor& value) const;
+
+  json_number number() const;
+  bool boolean() const;
+  // Decoded copy of a string value or key.
+  String str() const;
+
+  // Children in document order, an object yields each key followed by
+  // its value.
+  json_cursor begin() const { return json_cursor(doc, index + 1); }
+  json_cursor end() const;
+  json_cursor next() const;
+
+  json_cursor& operator++() { *this = next(); return *this; }
+  const json_cursor& operator*() const { return *this; }
+  bool operator==(const json_cursor& cursor) const { return index == cursor.index; }
+  bool operator!=(const json_cursor& cursor) const { return index != cursor.index; }
+  size_t position() const { return index; }
+
+  // Writes the text of the value as it is in the input.
+  std::ostream& print(std::ostream& os) const;
+
+private:
+  const char *text() const;
+  // Body of a string value or key, without the quotes.
+  const char *string_body(size_t& len, bool& escaped) const;
+  bool key_equals(const char *key, size_t len) const;
+};
+
+// On-demand access to a document. Only the structural index is built,
+// in one pass over the input (on several threads if asked), and values are
+// decoded when a cursor reads them. Input that is not resident is read
+// into memory first. Positions are 32-bit, input over 4GB throws before
+// it is read when its size is known, otherwise once 4GB have been read.
+class json_document {
+  friend class json_cursor;
+  std::unique_ptr<json_source> source;
+  std::vector<char> copy;
+  const char *text = nullptr;
+  size_t text_size = 0;
+  std::vector<uint32_t> positions;
+
+public:
+  json_document(std::string file_path, int threads = 1);
+  json_document(std::unique_ptr<json_source> source, int threads = 1);
+
+  json_cursor root() const { return json_cursor(this, 0); }
+  json_cursor operator[](const char *key) const { return root()[key]; }
+  json_cursor operator[](size_t i) const { return root().at(i); }
+  json_cursor operator[](int i) const { return root().at((size_t)i); }
+
+  size_t size() const { return text_size; }
+  size_t structurals() const { return positions.size(); }
+
+private:
+  char at(size_t index) const 
+    { return index < positions.size() ? text[positions[index]] : (char)0; }
+  // Index of the structural following the value at index.
+  size_t skip(size_t index) const;
 };
 
 ///===-----------------------------------------------------------------------===
@@ -172,7 +924,10 @@ public:
   bool is_string() const { return type == 3; }
   bool is_keyword() const { return type == 4; }
 
-  virtual std::ostream& print(std::ostream& os, bool format = false, std::string indent = "") const = 0;
+  // Formatted with two spaces, and `indent` at the start of every line
+  // after the first.
+  std::ostream& print(std::ostream& os, bool format = false, std::string indent = "") const;
+  virtual void write(json_writer& writer, bool format = false, size_t depth = 0) const = 0;
 };
 
 #ifndef CONFIG_ALLOCATOR
@@ -183,22 +938,58 @@ using jvalue = json_value*;
 
 class json_object : public json_value {
 public:
+#ifndef CONFIG_ALLOCATOR
   json_object() : json_value(0) {}
 #ifndef CONFIG_STABLE
   std::map<String, jvalue> keyvalue;
 #else
   std::vector<std::pair<String, jvalue>> keyvalue;
+#endif
+#elif defined(CONFIG_SHAPES)
+  json_object(const json_shape *shape, jvalue *values) 
+    : json_value(0), shape(shape), values(values) {}
+  const json_shape *shape;
+  // In document order, like the keys of the shape.
+  jvalue *values;
+
+  size_t size() const { return shape->size; }
+  const String& key(size_t i) const { return shape->keys[i]; }
+  jvalue value(size_t i) const { return values[i]; }
+  // nullptr when there is no such key.
+  jvalue find(const char *key) const;
+#else
+  json_object(json_arena& arena) : json_value(0), keyvalue(arena) {}
+#ifndef CONFIG_STABLE
+  std::map<String, jvalue, std::less<String>, 
+           json_arena_allocator<std::pair<const String, jvalue>>> keyvalue;
+#else
+  std::vector<std::pair<String, jvalue>, 
+              json_arena_allocator<std::pair<String, jvalue>>> keyvalue;
+#endif
 #endif
 
-  virtual std::ostream& print(std::ostream& os, bool format = false, std::string indent = "") const;
+  virtual void write(json_writer& writer, bool format = false, size_t depth = 0) const;
 };
 
+#ifdef CONFIG_COLUMNS
+class json_columns;
+#endif
+
 class json_array : public json_value {
 public:
+#ifndef CONFIG_ALLOCATOR
   json_array() : json_value(1) {}
   std::vector<jvalue> array;
+#else
+  json_array(json_arena& arena) : json_value(1), array(arena) {}
+  std::vector<jvalue, json_arena_allocator<jvalue>> array;
+#endif
+#ifdef CONFIG_COLUMNS
+  // The elements are stored here instead of `array` when set.
+  const json_columns *columns = nullptr;
+#endif
   
-  virtual std::ostream& print(std::ostream& os, bool format = false, std::string indent = "") const;
+  virtual void write(json_writer& writer, bool format = false, size_t depth = 0) const;
 };
 
 #ifndef CONFIG_ALLOCATOR
@@ -211,19 +1002,38 @@ using jarray = json_array*;
 
 class json_numeric : public json_value {
 public:
-  json_numeric(String num) : json_value(2), numstr(std::move(num)) {}
+  json_numeric(String num);
+  json_numeric(json_number num, String text = String())
+    : json_value(2), number(num), numstr(std::move(text)),
+      is_integer(num.type != json_number_type::floating) {}
+  json_number number;
+  // Original text, kept only if json_parser::keep_number_text() is set or
+  // the number is not a finite double.
   String numstr;
 
   bool is_integer = false;
-  virtual std::ostream& print(std::ostream& os, bool format = false, std::string indent = "") const;
+  int64_t to_int64() const { return number.to_int64(); }
+  uint64_t to_uint64() const { return number.to_uint64(); }
+  double to_double() const { return number.to_double(); }
+  virtual void write(json_writer& writer, bool format = false, size_t depth = 0) const;
 };
 
 class json_string : public json_value {
 public:
   json_string(String str) : json_value(3), str(std::move(str)) {}
+  // Refer the token body in the input, see json_parser::lazy_strings().
+  json_string(const char *body, size_t length, bool escaped)
+    : json_value(3), lazy(true), escaped(escaped), str((char *)body, length) {}
+  // `str` is the raw token body in the input, not null terminated, and 
+  // escaped if `escaped` is set. Use value() to read it.
+  bool lazy = false;
+  bool escaped = false;
   String str;
 
-  virtual std::ostream& print(std::ostream& os, bool format = false, std::string indent = "") const;
+  // The decoded string, copied out of the input if it is lazy.
+  String value() const;
+
+  virtual void write(json_writer& writer, bool format = false, size_t depth = 0) const;
 };
 
 class json_state : public json_value {
@@ -231,15 +1041,91 @@ public:
   json_state(json_token token) : json_value(4), type(token) {}
   json_token type;
 
-  virtual std::ostream& print(std::ostream& os, bool format = false, std::string indent = "") const;
+  virtual void write(json_writer& writer, bool format = false, size_t depth = 0) const;
 };
 
+#ifdef CONFIG_COLUMNS
+typedef enum class _json_column_type : unsigned char {
+  integer,  // int64_t
+  floating, // double
+  boolean,  // one bit each
+  string,   // String
+  value,    // jvalue, anything else
+} json_column_type;
+
+// One field of every element of an array, in document order.
+class json_column {
+public:
+  json_column_type type;
+  union {
+    const int64_t *integers;
+    const double *doubles;
+    const uint64_t *bits;
+    const String *strings;
+    const jvalue *values;
+  };
+
+  bool boolean(size_t i) const { return (bits[i / 64] >> (i % 64)) & 1; }
+  void write(json_writer& writer, size_t i, bool format = false, size_t depth = 0) const;
+};
+
+// Elements of an array by column. Arrays of numbers, booleans or strings
+// have one column, arrays of objects of one shape have a column per key.
+class json_columns {
+public:
+  size_t rows;
+  // nullptr when the elements are not objects.
+  const json_shape *shape;
+  const json_column *fields;
+
+  const json_column& column(size_t i = 0) const { return fields[i]; }
+  // nullptr when there is no such key.
+  const json_column *find(const char *key) const;
+
+  void write(json_writer& writer, size_t row, bool format = false, size_t depth = 0) const;
+};
+#endif
+
 class json_parser {
+  friend class json_parallel_parser;
   json_lexer lex;
-  jvalue _entry;
+  jvalue _entry = jvalue();
   bool _skip_literal = false;
+  bool _keep_number_text = false;
+  bool _build_tape = false;
+  json_tape _tape;
   bool _error = false;
   bool _reduce = false;
+  bool _json_lines = false;
+  bool _record_end = false;
+  int _depth = 0;
+  long long _records = 0;
+  std::function<void(jvalue)> _record_callback;
+  std::function<void(json_tape_ref)> _tape_record_callback;
+  long long _elements = 0;
+  std::function<void(jvalue)> _element_callback;
+  std::vector<std::string> _element_path;
+  std::vector<std::vector<std::string>> _selection;
+#ifdef CONFIG_ALLOCATOR
+  std::shared_ptr<json_symbol_table> _symbols = std::make_shared<json_symbol_table>();
+  std::vector<char> key_scratch;
+  bool _lazy_strings = false;
+#endif
+#ifdef CONFIG_SHAPES
+  // Members of the object being reduced, last one first.
+  struct member {
+    uint32_t id;
+    String key;
+    jvalue value;
+  };
+  std::vector<member> members;
+  std::vector<uint32_t> member_ids;
+  std::vector<String> member_keys;
+#endif
+  bool _skip_value = false;
+  // Only an object or array can lead to a selection.
+  bool _skip_scalar = false;
+  bool _skipped = false;
   
 #ifdef CONFIG_ALLOCATOR
   json_allocator<json_array> jarray_pool;
@@ -247,18 +1133,92 @@ class json_parser {
   json_allocator<json_string> jstring_pool;
   json_allocator<json_numeric> jnumeric_pool;
   json_allocator<json_state> jstate_pool;
+  // Strings and containers of the nodes.
+  json_arena data;
 #endif
 
 public:
-  json_parser(std::string file_path, size_t pool_capacity = 1024 * 256);
+  json_parser(std::string file_path, size_t pool_capacity = 1024 * 256,
+              json_input_mode mode = json_input_mode::stream);
+  json_parser(std::unique_ptr<json_source> source, size_t pool_capacity = 1024 * 256,
+              bool read_ahead = false, long long buffer_size = 1024 * 1024 * 32);
+  // Push parser, see feed().
+  json_parser(size_t pool_capacity = 1024 * 256);
 
   bool step();
+
+  // Parse input as it arrives in chunks of any size. Each chunk is parsed
+  // as far as it goes and only an unfinished token is copied, finish()
+  // parses the rest. Both return false on a syntax error. The structural
+  // index and select() are not used with pushed input.
+  bool feed(const char *ptr, size_t len);
+  bool finish();
+
   bool &skip_literal() { return _skip_literal; }
+  bool &structural_index() { return lex.structural_index(); }
+  int &index_threads() { return lex.index_threads(); }
+  bool &keep_number_text() { return _keep_number_text; }
   bool error() const { return _error; }
+
+#ifdef CONFIG_ALLOCATOR
+  // Leave string values in the input and decode them when they are read or
+  // printed, if the input is resident (memory_map or an in-memory source).
+  // The strings are valid while the parser is.
+  bool &lazy_strings() { return _lazy_strings; }
+#endif
+
+#ifdef CONFIG_COLUMNS
+  // Store the arrays of numbers, booleans, strings, or of flat objects of
+  // one shape by column (json_array::columns) as they close. Their element
+  // nodes are released, `array` is left empty. Not with keep_number_text().
+  bool &columnar() { return _columnar; }
+#endif
+
+  // Build the tape instead of json_value nodes, entry() stays empty and
+  // the element callback is not called. Records of json lines are handed
+  // to the tape record callback, the tape is reset after it returns and
+  // when the next record starts.
+  bool &build_tape() { return _build_tape; }
+  json_tape &tape() { return _tape; }
+
+  // Parse newline-delimited json (NDJSON, JSON Lines). Each top-level value
+  // is handed to the record callback and released, or left in entry() until
+  // the next record starts when no callback is set. Records must be
+  // separated by a line break.
+  bool &json_lines() { return _json_lines; }
+  void on_record(std::function<void(jvalue)> callback) { _record_callback = std::move(callback); }
+  void on_record(std::function<void(json_tape_ref)> callback) 
+    { _tape_record_callback = std::move(callback); }
+  long long records() const { return _records; }
+
+  // Hand every element of the array at the JSON Pointer path (the root by
+  // default) to the callback as soon as it is complete, instead of keeping
+  // it until the closing bracket. The array itself is left empty. With
+  // CONFIG_ALLOCATOR the element is released when the callback returns, so
+  // copy out what is needed instead of keeping the jvalue.
+  void on_element(std::function<void(jvalue)> callback, const std::string& path = "");
+  long long elements() const { return _elements; }
+
+#ifdef CONFIG_ALLOCATOR
+  // Object keys are interned into this table. Give the same table to the
+  // parsers of similar documents to keep one copy of their keys; it lives
+  // as long as any of them.
+  std::shared_ptr<json_symbol_table> symbols() const { return _symbols; }
+  void symbols(std::shared_ptr<json_symbol_table> table) { _symbols = std::move(table); }
+#endif
+
+  // Materialize only the values at the given paths, JSON Pointers
+  // ("/data/0/title") or simple JSONPath ("$.data[*].title") where '*'
+  // matches every member or element. Other values are skipped by bracket
+  // depth without tokens or nodes and left out of their parent, so they
+  // are not validated either. Not supported with build_tape().
+  void select(const std::vector<std::string>& paths);
   
   long long filesize() const { return lex.filesize(); }
   long long readsize() const { return lex.readsize(); }
   long long position() const { return lex.position(); }
+  long long progress_position() const { return lex.progress_position(); }
+  long long progress_size() const { return lex.progress_size(); }
 
   jvalue entry() { return _entry; }
 
@@ -273,10 +1233,352 @@ private:
   std::stack<json_token> token;
 #endif
 
-  std::stack<String> contents;
+  std::stack<json_slice> contents;
+  std::stack<json_number> numbers;
   std::stack<int> stack;
   std::stack<jvalue> values;
+  // Token text of stream mode input. Contents are pushed and popped in
+  // stack order, so popping a slice releases its tail.
+  std::vector<char> scratch;
   void reduce(int code);
+
+  // Containers opened on the way to the streamed array.
+  struct path_frame {
+    bool array;
+    bool matched;
+    bool key_matched = false;
+    long long index = 0;
+  };
+  std::vector<path_frame> frames;
+  void track_path(json_token type, int state);
+
+  // Containers opened on the way to the selected values.
+  struct select_frame {
+    bool array;
+    // Everything below is selected.
+    bool full;
+    // Selections leading through this container, and through the member
+    // or element being parsed.
+    std::vector<int> paths;
+    std::vector<int> child;
+    bool child_full = false;
+    long long index = 0;
+  };
+  std::vector<select_frame> selected;
+  void track_selection(json_token type, int state);
+  void select_child(select_frame& frame, const char *name, size_t len);
+  void select_element(select_frame& frame);
+  void tape_shift(json_token type, int state);
+  void stream_element();
+
+#ifdef CONFIG_ALLOCATOR
+  typedef std::array<json_arena::mark_type, 6> pool_mark;
+  pool_mark element_mark;
+  pool_mark mark_pools() const;
+  void rewind_pools(const pool_mark& mark);
+#endif
+#ifdef CONFIG_COLUMNS
+  bool _columnar = false;
+  // Pools when each open array started, released when it is columnized.
+  std::vector<pool_mark> array_marks;
+  // Elements copied out of the pools while they are rewound.
+  struct column_cell {
+    json_number number;
+    json_token keyword;
+    size_t offset, length;
+    // Lazy strings.
+    const char *body;
+    bool escaped;
+    char kind;
+  };
+  std::vector<json_column_type> column_types;
+  std::vector<uint64_t> column_words;
+  std::vector<column_cell> column_cells;
+  std::string column_text;
+  void columnize(const pool_mark& mark);
+#endif
+
+  void push_content();
+  void pop_content();
+  const char *content(const json_slice& slice) const;
+  String materialize(const json_slice& slice);
+  String materialize_key(const json_slice& slice, uint32_t *id = nullptr);
+#ifdef CONFIG_SHAPES
+  jvalue build_object();
+#endif
+};
+
+///===-----------------------------------------------------------------------===
+///
+///               Json SAX Parser
+///
+///===-----------------------------------------------------------------------===
+
+// LR tables of the json grammar, shared by json_parser and json_sax_parser.
+extern const int json_goto_table[28][20];
+extern const int json_production[19];
+extern const int json_group_table[19];
+const int json_accept_index = 28;
+
+// Empty events to derive a handler from. json_sax_parser calls the
+// handler through its own type, so hiding these is enough.
+struct json_sax_handler {
+  void start_object() {}
+  void end_object() {}
+  void start_array() {}
+  void end_array() {}
+  // Strings are decoded and valid only during the call.
+  void key(const char * /*str*/, size_t /*len*/) {}
+  void string(const char * /*str*/, size_t /*len*/) {}
+  void number(const json_number& /*number*/) {}
+  void boolean(bool /*value*/) {}
+  void null() {}
+};
+
+// Drives the handler in document order as the tokens are shifted, no node
+// is allocated. A syntax error may be found after some of the events of
+// the invalid part were sent.
+template<typename handler>
+class json_sax_parser {
+  json_lexer lex;
+  handler& _handler;
+  bool _error = false;
+  bool _reduce = false;
+  bool _skip_literal = false;
+  std::vector<int> stack;
+  std::vector<char> unescaped;
+
+public:
+  json_sax_parser(handler& h, std::string file_path, 
+                  json_input_mode mode = json_input_mode::stream)
+    : lex(file_path, 1024 * 1024 * 32, mode), _handler(h) {}
+  json_sax_parser(handler& h, std::unique_ptr<json_source> source, bool read_ahead = false)
+    : lex(std::move(source), 1024 * 1024 * 32, read_ahead), _handler(h) {}
+
+  bool step();
+  // Runs to the end, returns false on a syntax error.
+  bool parse() { while (step()); return !_error; }
+
+  bool &skip_literal() { return _skip_literal; }
+  bool &structural_index() { return lex.structural_index(); }
+  int &index_threads() { return lex.index_threads(); }
+  bool error() const { return _error; }
+
+  long long filesize() const { return lex.filesize(); }
+  long long position() const { return lex.position(); }
+  long long progress_position() const { return lex.progress_position(); }
+  long long progress_size() const { return lex.progress_size(); }
+
+private:
+  void shift(int state);
+};
+
+template<typename handler>
+bool json_sax_parser<handler>::step() {
+  if (!_reduce && !lex.next()) return false;
+
+  _reduce = false;
+
+  if (stack.empty())
+    stack.push_back(0);
+
+  int code = json_goto_table[stack.back()][(int)lex.type()];
+
+  if (code == json_accept_index)
+    return false;
+  else if (code > 0) {
+    stack.push_back(code);
+    shift(code);
+  }
+  else if (code < 0) {
+    stack.resize(stack.size() - json_production[-code]);
+    stack.push_back(json_goto_table[stack.back()][json_group_table[-code]]);
+    _reduce = true;
+  }
+  else {
+    _error = true;
+    return false;
+  }
+
+  return true;
+}
+
+template<typename handler>
+void json_sax_parser<handler>::shift(int state) {
+  switch (lex.type())
+  {
+  case json_token::object_starts: _handler.start_object(); break;
+  case json_token::object_ends: _handler.end_object(); break;
+  case json_token::array_starts: _handler.start_array(); break;
+  case json_token::array_ends: _handler.end_array(); break;
+  case json_token::v_true: _handler.boolean(true); break;
+  case json_token::v_false: _handler.boolean(false); break;
+  case json_token::v_null: _handler.null(); break;
+  case json_token::v_number: _handler.number(lex.number()); break;
+
+  case json_token::v_string:
+    {
+      const char *str = lex.token();
+      size_t len = lex.token_length();
+      // Shifting state 9 means the string is a key.
+      if (state != 9 && _skip_literal)
+        len = 0;
+      else if (lex.token_escaped()) {
+        unescaped.resize(len + 1);
+        len = json_unescape(unescaped.data(), str, len);
+        str = unescaped.data();
+      }
+      if (state == 9)
+        _handler.key(str, len);
+      else
+        _handler.string(str, len);
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Validator
+///
+///===-----------------------------------------------------------------------===
+
+// Checks that the input is json with the lexer and the LR tables alone.
+// There is no value stack, strings are not copied and numbers are not
+// decoded, only the states are kept. The lexer runs in strict mode.
+class json_validator {
+  json_lexer lex;
+  std::string file_path;
+  std::vector<int> stack;
+  long long counts[(int)json_token::error + 1] = {};
+  long long _error_offset = -1;
+  long long _error_line = 0;
+  long long _error_column = 0;
+
+public:
+  json_validator(std::string file_path, 
+                 json_input_mode mode = json_input_mode::memory_map);
+  json_validator(std::unique_ptr<json_source> source, bool read_ahead = false);
+
+  // Runs to the end or the first error, returns true if the input is json.
+  bool validate();
+
+  bool &structural_index() { return lex.structural_index(); }
+  int &index_threads() { return lex.index_threads(); }
+
+  // Byte offset of the first error, -1 if there is none.
+  long long error_offset() const { return _error_offset; }
+  // 1-based line and byte column of the error. 0 if the input is neither
+  // resident nor a file which can be read again.
+  long long error_line() const { return _error_line; }
+  long long error_column() const { return _error_column; }
+
+  // Tokens shifted of each type, up to the error.
+  long long count(json_token type) const { return counts[(int)type]; }
+  long long tokens() const;
+
+  long long filesize() const { return lex.filesize(); }
+  long long position() const { return lex.position(); }
+
+private:
+  bool fail(long long offset);
+};
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Formatter
+///
+///===-----------------------------------------------------------------------===
+
+// Writes the input again as it is lexed, pretty printed or minified, without
+// building any value. Only the LR states are kept, so the memory does not
+// depend on the size of the input. Strings and numbers are copied as they
+// are written in the input, through a json_writer.
+class json_formatter {
+  json_lexer lex;
+  std::vector<int> stack;
+  bool _pretty = true;
+  std::string _indent = "  ";
+  bool _error = false;
+
+  json_writer *writer = nullptr;
+  size_t depth = 0;
+  // A container was opened and nothing is written in it yet.
+  bool opened = false;
+
+public:
+  json_formatter(std::string file_path, json_input_mode mode = json_input_mode::stream);
+  json_formatter(std::unique_ptr<json_source> source, bool read_ahead = false);
+
+  // Minified when cleared.
+  bool &pretty() { return _pretty; }
+  // One level of indentation.
+  std::string &indent() { return _indent; }
+  bool &structural_index() { return lex.structural_index(); }
+  bool error() const { return _error; }
+
+  // Writes the whole input to os, returns false on a syntax error. The
+  // output up to the error is written.
+  bool format(std::ostream& os, size_t buffer_size = 1024 * 1024);
+  // The same into a writer, e.g. of a file. Lines are indented as set with
+  // json_writer::indent(), indent() is not used.
+  bool format(json_writer& writer);
+
+  long long filesize() const { return lex.filesize(); }
+  long long position() const { return lex.position(); }
+
+private:
+  void write(json_token type);
+  void newline() { if (_pretty) writer->newline(depth); }
+};
+
+///===-----------------------------------------------------------------------===
+///
+///               Json Parallel Parser
+///
+///===-----------------------------------------------------------------------===
+
+// Parses a top-level array on several threads. The input is split at the
+// commas of the root array, each chunk is parsed by its own json_parser and
+// the elements are joined into one root array. Inputs that are not resident
+// in memory or not an array are parsed on the calling thread.
+class json_parallel_parser {
+  std::unique_ptr<json_source> source;
+  int threads;
+  bool _skip_literal = false;
+  bool _keep_number_text = false;
+  bool _structural_index = false;
+  bool _error = false;
+  jvalue _entry = jvalue();
+  // Owners of the nodes of every chunk.
+  std::vector<std::unique_ptr<json_parser>> parsers;
+#ifdef CONFIG_ALLOCATOR
+  json_allocator<json_array> jarray_pool;
+  json_arena data;
+#endif
+
+public:
+  // Uses every core when threads is 0.
+  json_parallel_parser(std::string file_path, int threads = 0);
+  json_parallel_parser(std::unique_ptr<json_source> source, int threads = 0);
+
+  // Returns false on a syntax error.
+  bool parse();
+
+  bool &skip_literal() { return _skip_literal; }
+  bool &keep_number_text() { return _keep_number_text; }
+  bool &structural_index() { return _structural_index; }
+  bool error() const { return _error; }
+  size_t chunks() const { return parsers.size(); }
+
+  jvalue entry() { return _entry; }
+
+private:
+  bool parse_single();
+  void configure(json_parser& parser);
 };
 
 ///===-----------------------------------------------------------------------===
@@ -348,13 +1650,75 @@ class json_tree {
 
 public:
   json_tree(jvalue entry);
+  json_tree(const json_tape_ref& entry);
 
   jtree_value tree_entry() { return _tree_entry; }
 
 private:
-  jtree_value to_jtree_node(jvalue value);
-  jtree_value to_jtree_array(jarray array);
-  jtree_object to_jtree_object(jobject object);
+  jtree_value to_jtree_node(const json_value *value);
+  jtree_value to_jtree_array(const json_array *array);
+  jtree_object to_jtree_object(const json_object *object);
+  jtree_value to_jtree_node(const json_tape_ref& value);
+#ifdef CONFIG_COLUMNS
+  jtree_value to_jtree_node(const json_column& column, size_t row);
+  jtree_value to_jtree_row(const json_columns *columns, size_t row);
+#endif
+};
+
+// Builds the structure of json_tree from the events of json_sax_parser
+// instead of a parsed entry. Each element is merged into the schema of its
+// array like to_safe_array does as soon as it is complete and then dropped,
+// so memory follows the size of the schema, not the size of the input.
+class json_schema_builder : public json_sax_handler {
+  struct merged_key {
+    String key;
+    jtree_value value;
+    // The last element the key was found in and its position there.
+    size_t element;
+    size_t position;
+  };
+
+  struct frame {
+    bool is_array;
+    String key;
+    std::vector<std::pair<String, jtree_value>> members;
+    size_t count = 0;
+    bool consistent = true;
+    bool nulls = false;
+    // The last element that is not null and the keys of the objects.
+    jtree_value element;
+    std::map<String, size_t> keypair;
+    std::vector<merged_key> merged;
+    std::vector<jtree_value> elements;
+  };
+
+  std::vector<frame> frames;
+  jtree_value _tree_entry;
+  jtree_value scalars[(int)json_tree_type::none + 1];
+  size_t _element_limit = 256;
+
+public:
+  json_schema_builder();
+
+  void start_object();
+  void end_object();
+  void start_array();
+  void end_array();
+  void key(const char *str, size_t len);
+  void string(const char *str, size_t len);
+  void number(const json_number& number);
+  void boolean(bool value);
+  void null();
+
+  // Arrays of different elements are printed element by element, only the
+  // first element_limit() of them are kept.
+  size_t &element_limit() { return _element_limit; }
+  jtree_value tree_entry() { return _tree_entry; }
+
+private:
+  void value(jtree_value node);
+  void merge(frame& f, jtree_value node);
+  jtree_value merged_object(frame& f);
 };
 
 class json_tree_exporter {
@@ -0,0 +1,746 @@
+//===----------------------------------------------------------------------===//
+//
+//                      Json Parser for large data set
+//
+//===----------------------------------------------------------------------===//
+//
+//  Copyright (C) 2019. rollrat. All Rights Reserved.
+//
+//===----------------------------------------------------------------------===//
+
+#include "jsonhead.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#ifdef CONFIG_GZIP
+#include <zlib.h>
+#endif
+
+using namespace jsonhead;
+
+static int failures = 0;
+
+#define CHECK(expr) \
+  do { \
+    if (!(expr)) { \
+      std::cerr << __FILE__ << ':' << __LINE__ << ": " << #expr << '\n'; \
+      failures++; \
+    } \
+  } while (0)
+
+static const std::string sample =
+  "{\"data\": [{\"id\": 1, \"name\": \"a\", \"tags\": [\"x\", \"y\"]},\n"
+  "          {\"id\": -2, \"name\": \"b\\n\", \"tags\": []}],\n"
+  " \"version\": 2, \"ok\": true, \"none\": null}";
+static const std::string minified =
+  "{\"data\":[{\"id\":1,\"name\":\"a\",\"tags\":[\"x\",\"y\"]},"
+  "{\"id\":-2,\"name\":\"b\\n\",\"tags\":[]}],"
+  "\"version\":2,\"ok\":true,\"none\":null}";
+
+static const char *scratch = "jsonhead_test.json";
+
+static std::string file(const std::string& text) {
+  std::ofstream ofs(scratch, std::ios::binary);
+  ofs << text;
+  return scratch;
+}
+
+static std::string print(jvalue value) {
+  std::ostringstream os;
+  value->print(os);
+  return os.str();
+}
+
+static std::string records(int count) {
+  std::string text = "[";
+  for (int i = 0; i < count; i++)
+    text += (i ? ", " : "") + std::string("{\"i\": ") + std::to_string(i) +
+            ", \"s\": \"v[\\\"" + std::to_string(i) + "\\\"]\"}";
+  text += "]";
+  return text;
+}
+
+static std::unique_ptr<json_source> memory(const std::string& text) {
+  return std::unique_ptr<json_source>(new json_memory_source(text.data(), text.size()));
+}
+
+static std::string print(jtree_value value) {
+  std::ostringstream os;
+  value->print(os);
+  return os.str();
+}
+
+static void test_parser() {
+  json_parser ps(file(sample));
+  while (ps.step());
+  CHECK(!ps.error());
+  CHECK(print(ps.entry()) == minified);
+
+  json_tree tr(ps.entry());
+  CHECK(tr.tree_entry()->type == json_tree_type::object);
+}
+
+static void test_input_modes() {
+  for (auto mode : { json_input_mode::memory_map, json_input_mode::read_ahead }) {
+    json_parser ps(file(sample), 1024 * 256, mode);
+    while (ps.step());
+    CHECK(!ps.error());
+    CHECK(print(ps.entry()) == minified);
+    CHECK(ps.position() == (long long)sample.size());
+  }
+}
+
+static void test_structural_index() {
+  std::string text = "{\"a\": [1, \"x\\\"]\", true]}";
+  json_structural_index index;
+  index.index(text.data(), text.size());
+  std::vector<uint32_t> expect = { 0, 1, 4, 6, 7, 8, 10, 16, 18, 22, 23 };
+  CHECK(index.get() == expect);
+  CHECK(!index.in_string());
+
+  text = records(200);
+  json_parser ps(file(text));
+  while (ps.step());
+  std::string plain = print(ps.entry());
+
+  for (auto mode : { json_input_mode::stream, json_input_mode::memory_map }) {
+    json_parser ps(file(text), 1024 * 256, mode);
+    ps.structural_index() = true;
+    while (ps.step());
+    CHECK(!ps.error());
+    CHECK(print(ps.entry()) == plain);
+  }
+}
+
+static void test_token_slices() {
+  std::string text = "[\"a string that is longer than the buffer\", -12.5e-3, true,\n"
+                     " {\"key\": \"a\\\"b\"}]";
+  std::vector<std::string> expect = {
+    "[", "a string that is longer than the buffer", ",", "-12.5e-3", ",", "true", ",",
+    "{", "key", ":", "a\\\"b", "}", "]" };
+
+  for (auto mode : { json_input_mode::stream, json_input_mode::memory_map,
+                     json_input_mode::read_ahead }) {
+    json_lexer lex(file(text), 8, mode);
+    std::vector<std::string> tokens;
+    while (lex.next() && lex.type() != json_token::eof)
+      tokens.push_back(std::string(lex.token(), lex.token_length()));
+    CHECK(tokens == expect);
+  }
+}
+
+static void test_scan_string() {
+  for (size_t at = 0; at < 70; at++) {
+    std::string body(80, 'a');
+    body[at] = '"';
+    CHECK(json_scan_string(body.data(), body.data() + body.size()) == body.data() + at);
+    body[at] = '\\';
+    CHECK(json_scan_string(body.data(), body.data() + body.size()) == body.data() + at);
+    CHECK(json_scan_string(body.data(), body.data() + at) == body.data() + at);
+  }
+
+  std::string escaped = "a\\n\\\"\\u00e9\\ud83d\\ude00";
+  CHECK(json_unescape(escaped.data(), escaped.size()) == String("a\n\"\xc3\xa9\xf0\x9f\x98\x80"));
+}
+
+static void test_numbers() {
+  json_number number;
+  CHECK(json_parse_number("-42", 3, number));
+  CHECK(number.type == json_number_type::integer && number.i == -42);
+  CHECK(json_parse_number("9223372036854775808", 19, number));
+  CHECK(number.type == json_number_type::unsigned_integer && number.u == 9223372036854775808ull);
+  CHECK(json_parse_number("1.5e2", 5, number));
+  CHECK(number.type == json_number_type::floating && number.d == 150.0);
+
+  std::string text = "[1.5, -0.25, 1e2, 0.1, 9223372036854775808, -9223372036854775808]";
+  json_parser ps(file(text));
+  while (ps.step());
+  CHECK(!ps.error());
+  CHECK(print(ps.entry()) == "[1.5,-0.25,100.0,0.1,9223372036854775808,-9223372036854775808]");
+
+  json_parser keep(file(text));
+  keep.keep_number_text() = true;
+  while (keep.step());
+  CHECK(print(keep.entry()) == "[1.5,-0.25,1e2,0.1,9223372036854775808,-9223372036854775808]");
+
+  CHECK(json_parse_number("18446744073709551615", 20, number));
+  CHECK(number.type == json_number_type::unsigned_integer && number.u == UINT64_MAX);
+  CHECK(json_parse_number("18446744073709551616", 20, number));
+  CHECK(number.type == json_number_type::floating);
+  CHECK(json_parse_number("1e400", 5, number));
+  CHECK(!number.finite());
+
+  text = "[18446744073709551615, 1e400, -1e400]";
+  json_parser large(memory(text));
+  while (large.step());
+  CHECK(!large.error());
+  CHECK(print(large.entry()) == "[18446744073709551615,1e400,-1e400]");
+}
+
+static void test_sources() {
+  std::vector<std::unique_ptr<json_source>> sources;
+  sources.push_back(memory(sample));
+  sources.emplace_back(new json_file_source(file(sample)));
+  sources.emplace_back(new json_mmap_source(file(sample)));
+#ifdef CONFIG_GZIP
+  std::string gz_path = std::string(scratch) + ".gz";
+  gzFile gz = gzopen(gz_path.c_str(), "wb");
+  gzwrite(gz, sample.data(), (unsigned)sample.size());
+  gzclose(gz);
+  sources.emplace_back(new json_gzip_source(gz_path));
+  std::remove(gz_path.c_str());
+#endif
+
+  for (auto& source : sources) {
+    json_parser ps(std::move(source));
+    while (ps.step());
+    CHECK(!ps.error());
+    CHECK(print(ps.entry()) == minified);
+    CHECK(ps.progress_position() == ps.progress_size());
+  }
+}
+
+static void test_json_lines() {
+  std::string text = "{\"a\": 1}\n[2, 3]\r\n\n" + minified + "\n";
+  json_parser ps(memory(text));
+  ps.json_lines() = true;
+  std::vector<std::string> records;
+  ps.on_record([&](jvalue record) { records.push_back(print(record)); });
+  while (ps.step());
+  CHECK(!ps.error());
+  CHECK(ps.records() == 3);
+  CHECK(records == std::vector<std::string>({ "{\"a\":1}", "[2,3]", minified }));
+
+  json_parser indexed(memory(text));
+  indexed.json_lines() = true;
+  indexed.structural_index() = true;
+  while (indexed.step());
+  CHECK(!indexed.error() && indexed.records() == 3);
+
+  // The line break may come in another chunk than the next record.
+  json_parser pushed;
+  pushed.json_lines() = true;
+  for (size_t i = 0; i < text.size(); i++)
+    pushed.feed(text.data() + i, 1);
+  CHECK(pushed.finish());
+  CHECK(pushed.records() == 3);
+
+  for (std::string line : { "{}{}\n", "{\"a\": 1} [2]\n" }) {
+    for (bool structural : { false, true }) {
+      json_parser joined(memory(line));
+      joined.json_lines() = true;
+      joined.structural_index() = structural;
+      while (joined.step());
+      CHECK(joined.error());
+    }
+  }
+}
+
+static void test_on_element() {
+  json_parser ps(memory(sample));
+  std::vector<std::string> elements;
+  ps.on_element([&](jvalue element) { elements.push_back(print(element)); }, "/data");
+  while (ps.step());
+  CHECK(!ps.error());
+  CHECK(ps.elements() == 2);
+  CHECK(elements == std::vector<std::string>({
+    "{\"id\":1,\"name\":\"a\",\"tags\":[\"x\",\"y\"]}",
+    "{\"id\":-2,\"name\":\"b\\n\",\"tags\":[]}" }));
+  CHECK(print(ps.entry()) == "{\"data\":[],\"version\":2,\"ok\":true,\"none\":null}");
+
+  std::string text = "[[1], [2, [3]], {}]";
+  json_parser root(memory(text));
+  elements.clear();
+  root.on_element([&](jvalue element) { elements.push_back(print(element)); });
+  while (root.step());
+  CHECK(elements == std::vector<std::string>({ "[1]", "[2,[3]]", "{}" }));
+}
+
+static void test_tape() {
+  json_parser ps(memory(sample));
+  ps.build_tape() = true;
+  while (ps.step());
+  CHECK(!ps.error());
+  std::ostringstream os;
+  ps.tape().print(os);
+  CHECK(os.str() == minified);
+
+  auto data = ps.tape().root()["data"];
+  CHECK(data.is_array() && data.size() == 2);
+  CHECK(data.at(1)["name"].str() == String("b\n"));
+  CHECK(data.at(1)["id"].number().to_int64() == -2);
+  CHECK(ps.tape().root()["none"].is_keyword());
+
+  json_tree tr(ps.tape().root());
+  CHECK(tr.tree_entry()->type == json_tree_type::object);
+
+  // Each record of json lines starts a fresh tape.
+  std::string text = "{\"a\": 1}\n[2, 3]\n" + minified + "\n";
+  json_parser lines(memory(text));
+  lines.build_tape() = true;
+  lines.json_lines() = true;
+  std::vector<std::string> records;
+  lines.on_record([&](json_tape_ref record) {
+    std::ostringstream os;
+    record.print(os);
+    records.push_back(os.str());
+  });
+  while (lines.step());
+  CHECK(!lines.error());
+  CHECK(records == std::vector<std::string>({ "{\"a\":1}", "[2,3]", minified }));
+  CHECK(lines.tape().empty());
+
+  json_parser last(memory(text));
+  last.build_tape() = true;
+  last.json_lines() = true;
+  while (last.step());
+  std::ostringstream tail;
+  last.tape().print(tail);
+  CHECK(tail.str() == minified);
+}
+
+static void test_arena() {
+  json_arena arena(64);
+  arena.allocate(3, 1);
+  char *aligned = (char *)arena.allocate(8, 8);
+  CHECK((uintptr_t)aligned % 8 == 0);
+  auto mark = arena.mark();
+  CHECK(arena.allocate(200) != nullptr);
+  arena.rewind(mark);
+  CHECK(arena.allocate(8, 8) == aligned + 8);
+
+  std::string text = records(3000);
+  json_parser ps(memory(text));
+  while (ps.step());
+  json_parser small(memory(text), 16);
+  while (small.step());
+  CHECK(!small.error());
+  CHECK(print(small.entry()) == print(ps.entry()));
+}
+
+struct event_recorder : json_sax_handler {
+  std::string events;
+  void start_object() { events += '{'; }
+  void end_object() { events += '}'; }
+  void start_array() { events += '['; }
+  void end_array() { events += ']'; }
+  void key(const char *str, size_t len) { events += "k:" + std::string(str, len) + ' '; }
+  void string(const char *str, size_t len) { events += "s:" + std::string(str, len) + ' '; }
+  void number(const json_number& number) { events += "n:" + std::to_string(number.to_int64()) + ' '; }
+  void boolean(bool value) { events += value ? "true " : "false "; }
+  void null() { events += "null "; }
+};
+
+static void test_sax() {
+  event_recorder recorder;
+  json_sax_parser<event_recorder> sax(recorder, memory(sample));
+  CHECK(sax.parse());
+  CHECK(recorder.events ==
+        "{k:data [{k:id n:1 k:name s:a k:tags [s:x s:y ]}{k:id n:-2 k:name s:b\n k:tags []}]"
+        "k:version n:2 k:ok true k:none null }");
+
+  std::string text = "{\"a\": [1,]}";
+  event_recorder invalid;
+  json_sax_parser<event_recorder> error(invalid, memory(text));
+  CHECK(!error.parse());
+}
+
+static void test_parallel_parser() {
+  std::string text = records(5000);
+  json_parser ps(memory(text));
+  while (ps.step());
+
+  json_parallel_parser pps(memory(text), 4);
+  CHECK(pps.parse());
+  CHECK(pps.chunks() > 1);
+  CHECK(print(pps.entry()) == print(ps.entry()));
+
+  json_parallel_parser indexed(memory(text), 4);
+  indexed.structural_index() = true;
+  CHECK(indexed.parse());
+  CHECK(print(indexed.entry()) == print(ps.entry()));
+
+  json_parallel_parser object(memory(sample), 4);
+  CHECK(object.parse());
+  CHECK(print(object.entry()) == minified);
+
+  text.insert(text.find("}, {", text.size() / 2) + 1, ",");
+  json_parallel_parser error(memory(text), 4);
+  CHECK(!error.parse());
+}
+
+static std::vector<std::string> tokens(json_lexer& lex) {
+  std::vector<std::string> tokens;
+  while (lex.next() && lex.type() != json_token::eof)
+    tokens.push_back(std::string(lex.token(), lex.token_length()));
+  return tokens;
+}
+
+static void test_index_threads() {
+  std::string text = "[";
+  for (int i = 0; i < 20000; i++)
+    text += (i ? ", " : "") + std::string("{\"s\": \"") + std::string(2 * (i % 5), '\\') +
+            (i % 2 ? "\\\"" : "x") + "\", \"i\": [" + std::to_string(i) + "]}";
+  text += "]";
+
+  json_lexer plain(memory(text), 1024 * 256);
+  plain.structural_index() = true;
+  std::vector<std::string> expect = tokens(plain);
+  CHECK(expect.size() == 20000 * 12 + 1);
+
+  for (int threads : { 2, 3, 4 }) {
+    json_lexer lex(memory(text), 1024 * 256);
+    lex.structural_index() = true;
+    lex.index_threads() = threads;
+    CHECK(tokens(lex) == expect);
+  }
+}
+
+static void test_select() {
+  json_parser ps(memory(sample));
+  ps.select({ "/data/*/name", "$.data[0].tags[1]", "$.version" });
+  while (ps.step());
+  CHECK(!ps.error());
+  CHECK(print(ps.entry()) ==
+        "{\"data\":[{\"name\":\"a\",\"tags\":[\"y\"]},{\"name\":\"b\\n\"}],\"version\":2}");
+
+  // Scalars on the way to a selection cannot hold it.
+  std::string text = "{\"a\": \"s\", \"b\": 1, \"d\": [1, {\"e\": 2}, \"x\"]}";
+  json_parser prefix(memory(text));
+  prefix.select({ "/a/b", "/d/*/e" });
+  while (prefix.step());
+  CHECK(!prefix.error());
+  CHECK(print(prefix.entry()) == "{\"d\":[{\"e\":2}]}");
+}
+
+// Claims a size past the 32-bit positions of json_document.
+struct huge_source : json_source {
+  long long read(char *buffer, long long size) override { return 0; }
+  long long size() const override { return 5LL * 1024 * 1024 * 1024; }
+};
+
+static void test_document() {
+  json_document doc(memory(sample));
+  CHECK(doc.root().is_object() && doc.root().size() == 4);
+  CHECK(doc["data"].size() == 2);
+  CHECK(doc["data"][1]["name"].str() == String("b\n"));
+  CHECK(doc["data"][1]["id"].number().to_int64() == -2);
+  CHECK(doc["data"][0]["tags"][1].str() == String("y"));
+  CHECK(doc["version"].number().to_int64() == 2);
+  CHECK(doc["ok"].boolean());
+  CHECK(doc["none"].is_null());
+
+  json_cursor value(&doc, 0);
+  CHECK(!doc.root().find("missing", value));
+
+  std::string names;
+  auto data = doc["data"];
+  for (auto it = data.begin(); it != data.end(); ++it)
+    names += it["name"].str().Reference();
+  CHECK(names == "ab\n");
+
+  std::ostringstream os;
+  doc["data"][0]["tags"].print(os);
+  CHECK(os.str() == "[\"x\", \"y\"]");
+
+  bool refused = false;
+  try {
+    json_document huge(std::unique_ptr<json_source>(new huge_source()));
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  CHECK(refused);
+}
+
+static void test_feed() {
+  for (size_t chunk : { 1, 7, 64 }) {
+    json_parser ps;
+    bool ok = true;
+    for (size_t i = 0; i < sample.size() && ok; i += chunk)
+      ok = ps.feed(sample.data() + i, std::min(chunk, sample.size() - i));
+    CHECK(ok);
+    CHECK(ps.finish());
+    CHECK(print(ps.entry()) == minified);
+  }
+
+  json_parser truncated;
+  CHECK(truncated.feed(sample.data(), sample.size() - 1));
+  CHECK(!truncated.finish());
+
+  json_parser invalid;
+  CHECK(!invalid.feed("[1,]", 4));
+}
+
+static void test_symbols() {
+  json_symbol_table table(2);
+  CHECK(table.intern("id", 2) == 0);
+  CHECK(table.intern("name", 4) == 1);
+  CHECK(table.intern("id", 2) == 0);
+  CHECK(table.intern("tags", 4) == json_symbol_table::npos);
+  CHECK(table.find("name", 4) == 1);
+  CHECK(table.find("tags", 4) == json_symbol_table::npos);
+  CHECK(table.name(1) == String("name"));
+
+  std::string text = records(100);
+  json_parser first(memory(text));
+  while (first.step());
+  CHECK(first.symbols()->size() == 2);
+
+  json_parser second(memory(sample));
+  second.symbols(first.symbols());
+  while (second.step());
+  CHECK(print(second.entry()) == minified);
+  CHECK(first.symbols()->size() == 9);
+}
+
+static void test_shapes() {
+  std::string text = "[{\"a\": 1, \"b\": 2}, {\"a\": 3, \"b\": 4}, {\"b\": 5, \"a\": 6}, {}]";
+  json_parser ps(memory(text));
+  while (ps.step());
+  CHECK(print(ps.entry()) == "[{\"a\":1,\"b\":2},{\"a\":3,\"b\":4},{\"b\":5,\"a\":6},{}]");
+#ifdef CONFIG_SHAPES
+  // Elements are kept last one first.
+  auto& elements = static_cast<jarray>(ps.entry())->array;
+  auto first = static_cast<jobject>(elements[3]);
+  auto second = static_cast<jobject>(elements[2]);
+  auto third = static_cast<jobject>(elements[1]);
+  CHECK(first->shape == second->shape && first->shape != third->shape);
+  CHECK(ps.symbols()->shapes() == 2);
+  CHECK(static_cast<json_numeric *>(third->find("a"))->to_int64() == 6);
+  CHECK(third->find("c") == nullptr);
+#endif
+}
+
+static void test_columns() {
+  std::string text = "{\"n\": [1, -2, 3], \"d\": [0.5, 1.5], \"b\": [true, false, true],"
+                     " \"s\": [\"x\", \"y\\n\"], \"rows\": [{\"a\": 1, \"b\": \"p\"}, {\"a\": 2, \"b\": null}],"
+                     " \"mixed\": [1, \"x\", [2]]}";
+  std::string expect = "{\"n\":[1,-2,3],\"d\":[0.5,1.5],\"b\":[true,false,true],"
+                       "\"s\":[\"x\",\"y\\n\"],\"rows\":[{\"a\":1,\"b\":\"p\"},{\"a\":2,\"b\":null}],"
+                       "\"mixed\":[1,\"x\",[2]]}";
+  json_parser ps(memory(text));
+#ifdef CONFIG_COLUMNS
+  ps.columnar() = true;
+#endif
+  while (ps.step());
+  CHECK(!ps.error());
+  CHECK(print(ps.entry()) == expect);
+#ifdef CONFIG_COLUMNS
+  auto root = static_cast<jobject>(ps.entry());
+  auto numbers = static_cast<jarray>(root->find("n"))->columns;
+  CHECK(numbers && numbers->rows == 3 && numbers->column().type == json_column_type::integer);
+  CHECK(numbers->column().integers[1] == -2);
+  CHECK(static_cast<jarray>(root->find("b"))->columns->column().boolean(2));
+  auto rows = static_cast<jarray>(root->find("rows"))->columns;
+  CHECK(rows && rows->find("a")->integers[1] == 2);
+  CHECK(!static_cast<jarray>(root->find("mixed"))->columns);
+#endif
+
+  json_parser nodes(memory(text));
+  while (nodes.step());
+  json_tree columns_tree(ps.entry()), nodes_tree(nodes.entry());
+  CHECK(print(columns_tree.tree_entry()) == print(nodes_tree.tree_entry()));
+}
+
+static void test_lazy_strings() {
+#ifdef CONFIG_ALLOCATOR
+  json_parser ps(memory(sample));
+  ps.lazy_strings() = true;
+  while (ps.step());
+  CHECK(!ps.error());
+  CHECK(print(ps.entry()) == minified);
+#ifdef CONFIG_SHAPES
+  // The last element of "data", elements are kept last one first.
+  auto data = static_cast<jarray>(static_cast<jobject>(ps.entry())->find("data"));
+  auto name = static_cast<json_string *>(static_cast<jobject>(data->array[0])->find("name"));
+  CHECK(name->lazy && name->escaped);
+  CHECK(name->value() == String("b\n"));
+#endif
+#endif
+}
+
+struct validator_case {
+  const char *text;
+  long long offset;
+};
+
+static void test_validator() {
+  validator_case cases[] = {
+    { "[0, -0.5e3, \"\\u00e9\xc3\xa9\"]", -1 },
+    { "{\"a\": 1,}", 8 },
+    { "[1, 2", 5 },
+    { "[1] [2]", 4 },
+    { "[tru]", 1 },
+    { "[01]", 2 },
+    { "[-012]", 3 },
+    { "[\"a\\x\"]", 4 },
+    { "[\"\\u12g4\"]", 6 },
+    { "[\"a\tb\"]", 3 },
+    { "[\"\xff\"]", 2 },
+    { "[\"\xc3\"]", 2 },
+    { "[\"\xed\xa0\x80\"]", 2 },
+    { "[\"\xf0\x9f\x98\x80\", \"\xe2\x82\xac\"]", -1 },
+  };
+  for (auto& c : cases) {
+    std::string text = c.text;
+    json_validator v(memory(text));
+    CHECK(v.validate() == (c.offset < 0));
+    CHECK(v.error_offset() == c.offset);
+  }
+
+  json_validator v(memory(sample));
+  CHECK(v.validate());
+  CHECK(v.count(json_token::v_number) == 3);
+  CHECK(v.count(json_token::v_string) == 14);
+
+  std::string text = "{\n  \"a\": [1,\n        2,]}";
+  for (auto mode : { json_input_mode::stream, json_input_mode::memory_map }) {
+    json_validator line(file(text), mode);
+    CHECK(!line.validate());
+    CHECK(line.error_line() == 3 && line.error_column() == 11);
+  }
+
+  // A NUL byte is not the end of the input.
+  std::string nul("[1,2]\0 garbage {{{", 18);
+  for (auto mode : { json_input_mode::stream, json_input_mode::memory_map }) {
+    json_validator trailing(file(nul), mode);
+    CHECK(!trailing.validate());
+    CHECK(trailing.error_offset() == 5);
+  }
+  json_validator structural(memory(nul));
+  structural.structural_index() = true;
+  CHECK(!structural.validate());
+  CHECK(structural.error_offset() == 5);
+
+  json_parser ps(memory(nul));
+  while (ps.step());
+  CHECK(ps.error());
+}
+
+static void test_formatter() {
+  json_formatter minify(memory(sample));
+  minify.pretty() = false;
+  std::ostringstream os;
+  CHECK(minify.format(os));
+  CHECK(os.str() == minified);
+
+  std::string text = "{\"a\": [1, {}, []], \"b\": {\"c\": \"d\\\"\"}}";
+  json_formatter pretty(memory(text));
+  pretty.indent() = "\t";
+  os.str("");
+  CHECK(pretty.format(os, 16));
+  CHECK(os.str() == "{\n\t\"a\": [\n\t\t1,\n\t\t{},\n\t\t[]\n\t],\n\t\"b\": {\n\t\t\"c\": \"d\\\"\"\n\t}\n}\n");
+
+  os.str("");
+  {
+    json_writer writer(os);
+    writer.indent(" ", "> ");
+    json_formatter prefixed(memory(text));
+    CHECK(prefixed.format(writer));
+  }
+  CHECK(os.str() == "{\n>  \"a\": [\n>   1,\n>   {},\n>   []\n>  ],\n>  \"b\": {\n>   \"c\": \"d\\\"\"\n>  }\n> }\n");
+
+  text = "{\"a\": [1,]}";
+  json_formatter invalid(memory(text));
+  os.str("");
+  CHECK(!invalid.format(os));
+  CHECK(invalid.error());
+}
+
+static void test_writer() {
+  std::string text = "a\"\\\n\x01 long enough to flush";
+  std::ostringstream os;
+  {
+    json_writer writer(os, 16);
+    writer.put('[');
+    writer.string(text.data(), text.size());
+    writer.put(',');
+    writer.integer(INT64_MIN);
+    writer.put(',');
+    writer.unsigned_integer(UINT64_MAX);
+    writer.put(',');
+    writer.floating(0.1);
+    writer.put(',');
+    writer.floating(2);
+    writer.put(',');
+    writer.floating(1e300);
+    writer.put(',');
+    writer.floating(1e300 * 1e300);
+    writer.put(',');
+    writer.floating(-(1e300 * 1e300));
+    writer.put(',');
+    writer.floating(std::nan(""));
+    writer.put(']');
+  }
+  CHECK(os.str() == "[\"a\\\"\\\\\\n\\u0001 long enough to flush\","
+                    "-9223372036854775808,18446744073709551615,0.1,2.0,1e+300,null,null,null]");
+
+  json_parser ps(memory(sample));
+  while (ps.step());
+  std::ostringstream pretty;
+  ps.entry()->print(pretty, true);
+  for (bool format : { false, true }) {
+    {
+      json_writer writer{ std::string(scratch) };
+      ps.entry()->write(writer, format);
+    }
+    std::ifstream ifs(scratch, std::ios::binary);
+    std::string written((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    CHECK(written == (format ? pretty.str() : minified));
+  }
+}
+
+static void test_schema_builder() {
+  std::string texts[] = { sample, records(300),
+                          "[{\"a\": 1}, {\"a\": \"x\", \"b\": null}, [1, [true]], 2.5, \"s\"]" };
+  for (auto& text : texts) {
+    json_parser ps(memory(text));
+    while (ps.step());
+    json_tree tr(ps.entry());
+
+    json_schema_builder schema;
+    json_sax_parser<json_schema_builder> sax(schema, memory(text));
+    CHECK(sax.parse());
+    CHECK(print(schema.tree_entry()) == print(tr.tree_entry()));
+  }
+}
+
+int main() {
+  test_parser();
+  test_input_modes();
+  test_structural_index();
+  test_token_slices();
+  test_scan_string();
+  test_numbers();
+  test_sources();
+  test_json_lines();
+  test_on_element();
+  test_tape();
+  test_arena();
+  test_sax();
+  test_parallel_parser();
+  test_index_threads();
+  test_select();
+  test_document();
+  test_feed();
+  test_symbols();
+  test_shapes();
+  test_columns();
+  test_lazy_strings();
+  test_validator();
+  test_formatter();
+  test_writer();
+  test_schema_builder();
+
+  std::remove(scratch);
+  if (failures > 0) {
+    std::cerr << failures << " failed\n";
+    return 1;
+  }
+  std::cout << "ok\n";
+  return 0;
+}